@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "accesslog.h"
+
+// -1 while logging is off.
+static int log_fd = -1;
+
+// Each thread's buffer hangs off this key; its destructor flushes the buffer when the thread exits.
+static pthread_key_t buffer_key;
+
+typedef struct log_buffer
+{
+    size_t len;
+    char data[ACCESS_LOG_BUFFER];
+} log_buffer;
+
+// Append the buffer to the log in a single write. With O_APPEND the kernel places each
+// write at the end of the file atomically, so threads never need to coordinate.
+static void flush_buffer(log_buffer *buffer)
+{
+    if (buffer->len > 0 && write(log_fd, buffer->data, buffer->len) < 0)
+    {
+        fprintf(stderr, "\033[31mfailure:\033[0m write access log. dropping %zu bytes of it.\n", buffer->len);
+    }
+    buffer->len = 0;
+}
+
+static void release_buffer(void *buffer)
+{
+    flush_buffer(buffer);
+    free(buffer);
+}
+
+void init_access_log(char *path)
+{
+    struct stat st;
+
+    if (path == NULL)
+        return;
+
+    if ((log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+    {
+        fprintf(stderr, "\033[31mfailure:\033[0m open access log %s. logging disabled.\n", path);
+        return;
+    }
+    if (fstat(log_fd, &st) == 0 && st.st_size == 0)
+    {
+        write(log_fd, ACCESS_LOG_MAGIC, strlen(ACCESS_LOG_MAGIC));
+    }
+    pthread_key_create(&buffer_key, release_buffer);
+}
+
+// Record one request. Only touches the calling thread's buffer (until it fills up).
+void access_log(access_record *record, char *line)
+{
+    log_buffer *buffer;
+    size_t line_len, needed;
+
+    if (log_fd < 0)
+        return;
+
+    if ((buffer = pthread_getspecific(buffer_key)) == NULL)
+    {
+        if ((buffer = malloc(sizeof(log_buffer))) == NULL)
+            return;
+        buffer->len = 0;
+        pthread_setspecific(buffer_key, buffer);
+    }
+
+    // the request line, without its trailing "\r\n".
+    line_len = strcspn(line, "\r\n");
+    if (line_len > UINT16_MAX)
+        line_len = UINT16_MAX;
+    record->line_len = line_len;
+    record->reserved = 0;
+
+    needed = sizeof(access_record) + line_len;
+    if (buffer->len + needed > ACCESS_LOG_BUFFER)
+        flush_buffer(buffer);
+    if (needed > ACCESS_LOG_BUFFER)
+        return; // can't happen for lines read by read_line, but be safe.
+
+    memcpy(buffer->data + buffer->len, record, sizeof(access_record));
+    memcpy(buffer->data + buffer->len + sizeof(access_record), line, line_len);
+    buffer->len += needed;
+}
+
+// Write out whatever the calling thread has buffered.
+void access_log_flush()
+{
+    log_buffer *buffer;
+
+    if (log_fd >= 0 && (buffer = pthread_getspecific(buffer_key)) != NULL)
+        flush_buffer(buffer);
+}
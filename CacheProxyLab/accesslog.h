@@ -0,0 +1,26 @@
+/*
+Binary, append-only access log: one record per request the proxy served.
+Records are collected in a per-thread buffer (no locking) and appended to the log
+file in batches; see log2trace.c for turning a log into a trace for cachesim.
+ */
+#include <stdint.h>
+
+#define ACCESS_LOG_MAGIC "PXYLOG1\n" // first 8 bytes of every log file
+#define ACCESS_LOG_BUFFER 16384      // bytes buffered per thread before a flush
+
+/* On disk: this header (packed, host byte order), then line_len bytes of request line. */
+typedef struct __attribute__((packed)) access_record
+{
+    uint64_t timestamp_us; // wall clock time the request arrived (us since the epoch)
+    uint32_t thread_id;    // kernel thread id of the worker that served it
+    uint32_t bytes;        // bytes sent to the client
+    uint32_t origin_us;    // time spent fetching from the origin (0 for a hit)
+    uint32_t total_us;     // time from request arrival to the last byte sent
+    uint16_t line_len;     // length of the request line that follows
+    uint8_t hit;           // 1 if served from the cache
+    uint8_t reserved;
+} access_record;
+
+void init_access_log(char *path);
+void access_log(access_record *record, char *line);
+void access_log_flush();
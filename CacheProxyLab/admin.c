@@ -0,0 +1,203 @@
+#define _GNU_SOURCE // open_memstream
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "admin.h"
+#include "cache.h"
+#include "http.h"
+#include "io.h"
+
+#define ADMIN_TOP_DEFAULT 10 // entries /top/hits/ and /top/size/ list, if not told
+
+static const char ADMIN_RESPONSE_FMT[] =
+    "HTTP/1.0 %d %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n";
+static const char ADMIN_USAGE[] =
+    "usage: GET /purge/<url> | /ban/prefix/<prefix> | /ban/regex/<regex> | /top/hits/<n> | /top/size/<n> | /dump\n";
+
+static int admin_fd = -1;
+
+// Decode the %XX escapes in s, in place.
+static void percent_decode(char *s)
+{
+    char *out = s;
+    unsigned int c;
+
+    for (; *s != '\0'; s++)
+    {
+        if (*s == '%' && sscanf(s + 1, "%2x", &c) == 1 && s[1] != '\0' && s[2] != '\0')
+        {
+            *out++ = c;
+            s += 2;
+        }
+        else
+        {
+            *out++ = *s;
+        }
+    }
+    *out = '\0';
+}
+
+// Carry out the admin request for path, printing the answer to out. Returns the status to answer with.
+static int run(char *path, FILE *out)
+{
+    long n;
+    int by_size;
+
+    if (!strncmp(path, "/purge/", strlen("/purge/")))
+    {
+        path += strlen("/purge/");
+        cache_wrlock();
+        n = cache_purge(path);
+        cache_unlock();
+        fprintf(out, "purged %ld cached response(s) for %s\n", n, path);
+        return 200;
+    }
+    if (!strncmp(path, "/ban/prefix/", strlen("/ban/prefix/")))
+    {
+        path += strlen("/ban/prefix/");
+        cache_wrlock();
+        n = cache_ban(path, 0);
+        cache_unlock();
+        fprintf(out, "banned URLs starting with %s (%ld cached response(s) removed now)\n", path, n);
+        return 200;
+    }
+    if (!strncmp(path, "/ban/regex/", strlen("/ban/regex/")))
+    {
+        path += strlen("/ban/regex/");
+        percent_decode(path);
+        cache_wrlock();
+        n = cache_ban(path, 1);
+        cache_unlock();
+        if (n < 0)
+        {
+            fprintf(out, "not a regular expression: %s\n", path);
+            return 400;
+        }
+        fprintf(out, "banned URLs matching %s (%ld cached response(s) removed now)\n", path, n);
+        return 200;
+    }
+    if (!strncmp(path, "/top/hits", strlen("/top/hits")) || !strncmp(path, "/top/size", strlen("/top/size")))
+    {
+        by_size = path[strlen("/top/")] == 's';
+        path += strlen("/top/hits");
+        n = *path == '/' ? atol(path + 1) : 0;
+        cache_rdlock();
+        cache_top(out, n > 0 ? n : ADMIN_TOP_DEFAULT, by_size);
+        cache_unlock();
+        return 200;
+    }
+    if (!strcmp(path, "/dump"))
+    {
+        cache_rdlock();
+        cache_dump(out);
+        cache_unlock();
+        return 200;
+    }
+    fputs(ADMIN_USAGE, out);
+    return 404;
+}
+
+// Read an admin request from fd, and answer it.
+static void handle_admin(int fd)
+{
+    line_reader reader;
+    char line[MAX_LINE];
+    char method[16];
+    char path[MAX_LINE];
+    char header[256];
+    char *answer = NULL;
+    size_t answer_len = 0;
+    FILE *out;
+    int n, status;
+
+    line_reader_init(&reader, fd);
+    n = read_line_buffered(&reader, line);
+    if (n <= 0)
+        return;
+    line[n < MAX_LINE ? n : MAX_LINE - 1] = '\0';
+    if (sscanf(line, "%15s %8191s", method, path) != 2 || !skip_request_header(&reader))
+        return;
+    if ((out = open_memstream(&answer, &answer_len)) == NULL)
+        return;
+
+    if (strcasecmp(method, "GET"))
+    {
+        fputs(ADMIN_USAGE, out);
+        status = 405;
+    }
+    else
+    {
+        status = run(path, out);
+    }
+    fclose(out);
+
+    n = snprintf(header, sizeof(header), ADMIN_RESPONSE_FMT, status,
+                 status == 200 ? "OK" : status == 400 ? "Bad Request" : status == 404 ? "Not Found" : "Method Not Allowed",
+                 answer_len);
+    if (write_all(fd, header, n) >= 0)
+        write_all(fd, answer, answer_len);
+    free(answer);
+}
+
+static void *adminLoop(void *args)
+{
+    int fd;
+
+    (void)args;
+    while (1)
+    {
+        fd = accept4(admin_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break; // (admin_stop)
+        }
+        handle_admin(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+// Listen for admin requests on 127.0.0.1:port, and answer them on a thread of their own.
+// If the port can't be had, the proxy runs without (it says so).
+void admin_start(int port)
+{
+    struct sockaddr_in addr;
+    pthread_t tid;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    // (SO_REUSEPORT: a hot-restarted proxy binds it while the old one still drains.)
+    admin_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (admin_fd < 0 ||
+        setsockopt(admin_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0 ||
+        setsockopt(admin_fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0 ||
+        bind(admin_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(admin_fd, 16) < 0 ||
+        pthread_create(&tid, NULL, adminLoop, NULL) != 0)
+    {
+        fprintf(stderr, "\033[31mfailure:\033[0m admin port %d: %s. running without it.\n", port, strerror(errno));
+        if (admin_fd >= 0)
+            close(admin_fd);
+        admin_fd = -1;
+        return;
+    }
+    pthread_detach(tid);
+    printf("\e[1madmin requests on 127.0.0.1:%d\e[0m\n", port);
+}
+
+// Stop taking admin requests (the one being answered, if any, is finished).
+void admin_stop()
+{
+    if (admin_fd >= 0)
+        shutdown(admin_fd, SHUT_RDWR);
+}
@@ -0,0 +1,20 @@
+/*
+Admin requests, on a port of their own (-A) that only this host can reach (127.0.0.1):
+    GET /purge/<url>          remove what is cached for url (all its variants)
+    GET /ban/prefix/<prefix>  what is cached so far for URLs that start with prefix is stale
+    GET /ban/regex/<regex>    ... for URLs that match regex (POSIX extended; %-escapes decoded)
+    GET /top/hits/<n>         the n cached responses served most often
+    GET /top/size/<n>         the n biggest cached responses
+    GET /dump                 everything cached, least recently used (next to be evicted) first
+e.g. curl http://localhost:<port>/purge/http://www.example.com/
+Answers are text/plain. Requests are handled one at a time, on a thread of their own. Each
+holds the cache's lock only while it runs, as a request for a cached object does; the answer
+is written after.
+ */
+#ifndef ADMIN_H
+#define ADMIN_H
+
+void admin_start(int port);
+void admin_stop();
+
+#endif/*ADMIN_H*/
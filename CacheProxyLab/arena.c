@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "arena.h"
+
+// A free chunk: on the free list of its order (the order itself is in chunk_order).
+typedef struct arena_free_chunk
+{
+    uint32_t prev;
+    uint32_t next;
+} arena_free_chunk;
+
+#define FREE(off) ((arena_free_chunk *)(base + (off)))
+#define ORDER_OF(off) (chunks->chunk_order[(off) >> ARENA_MIN_ORDER])
+
+static void push_free(arena_chunks *chunks, char *base, uint32_t off, int order)
+{
+    FREE(off)->prev = ARENA_NIL;
+    FREE(off)->next = chunks->free_list[order];
+    if (chunks->free_list[order] != ARENA_NIL)
+        FREE(chunks->free_list[order])->prev = off;
+    chunks->free_list[order] = off;
+    ORDER_OF(off) = order + 1;
+}
+
+static void remove_free(arena_chunks *chunks, char *base, uint32_t off, int order)
+{
+    if (FREE(off)->prev != ARENA_NIL)
+        FREE(FREE(off)->prev)->next = FREE(off)->next;
+    else
+        chunks->free_list[order] = FREE(off)->next;
+    if (FREE(off)->next != ARENA_NIL)
+        FREE(FREE(off)->next)->prev = FREE(off)->prev;
+    ORDER_OF(off) = 0;
+}
+
+// Start out with one free chunk: the whole arena.
+void arena_chunks_init(arena_chunks *chunks, char *base)
+{
+    int i;
+
+    for (i = 0; i < ARENA_ORDERS; i++)
+        chunks->free_list[i] = ARENA_NIL;
+    chunks->chunk_bytes = 0;
+    memset(chunks->chunk_order, 0, sizeof(chunks->chunk_order));
+    push_free(chunks, base, 0, ARENA_ORDER);
+}
+
+// The order of the smallest chunk size bytes fit in (more than ARENA_ORDER if none does).
+int arena_order(size_t size)
+{
+    int order = ARENA_MIN_ORDER;
+
+    while (((size_t)1 << order) < size && order <= ARENA_ORDER)
+        order++;
+    return order;
+}
+
+// A chunk of 2^order bytes: the smallest free chunk that is big enough, halved until it fits
+// (the other halves go on the free lists). ARENA_NIL if there is none.
+uint32_t arena_alloc(arena_chunks *chunks, char *base, int order)
+{
+    int k;
+    uint32_t off;
+
+    for (k = order; k < ARENA_ORDERS && chunks->free_list[k] == ARENA_NIL; k++)
+        ;
+    if (k >= ARENA_ORDERS)
+        return ARENA_NIL;
+    off = chunks->free_list[k];
+    remove_free(chunks, base, off, k);
+    while (k > order)
+    {
+        k--;
+        push_free(chunks, base, off + ((uint32_t)1 << k), k);
+    }
+    ORDER_OF(off) = (order + 1) | ARENA_IN_USE;
+    chunks->chunk_bytes += (size_t)1 << order;
+    return off;
+}
+
+// Give a chunk back, merging it with its buddy (the other half of the chunk twice its size)
+// for as long as that is free too, so the arena doesn't crumble into small chunks.
+void arena_free(arena_chunks *chunks, char *base, uint32_t off)
+{
+    int order = (ORDER_OF(off) & ~ARENA_IN_USE) - 1;
+    uint32_t buddy;
+
+    chunks->chunk_bytes -= (size_t)1 << order;
+    while (order < ARENA_ORDER)
+    {
+        buddy = off ^ ((uint32_t)1 << order);
+        if (ORDER_OF(buddy) != order + 1)
+            break;
+        remove_free(chunks, base, buddy, order);
+        if (buddy < off)
+            off = buddy;
+        order++;
+    }
+    push_free(chunks, base, off, order);
+}
+
+// Map size bytes (at least ARENA_SIZE; the arena is the first ARENA_SIZE of them) at an address
+// aligned to a huge page: of the file fd, shared, or (fd -1) private memory of this process.
+// Private memory comes from a reserved huge page if there is one, and otherwise (as the file's
+// does) from a transparent huge page, once it is first touched, if the kernel has one to give.
+// With numa_node >= 0 the pages are taken from that NUMA node (where the threads that serve the
+// cache run). *backing says which it tried for (ARENA_*). Returns NULL if it can't be mapped.
+char *arena_map(int fd, size_t size, int numa_node, int *backing)
+{
+    char *reserved, *base;
+    size_t pages = (size + getpagesize() - 1) & ~(size_t)(getpagesize() - 1);
+    unsigned long nodes;
+
+    *backing = ARENA_HUGETLB;
+    base = fd < 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0)
+                  : MAP_FAILED;
+    if (base == MAP_FAILED)
+    {
+        // (mmap aligns to a small page only: map over the aligned part of a range a huge page bigger.)
+        reserved = mmap(NULL, pages + ARENA_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (reserved == MAP_FAILED)
+            return NULL;
+        base = (char *)(((uintptr_t)reserved + ARENA_SIZE - 1) & ~(uintptr_t)(ARENA_SIZE - 1));
+        if (base > reserved)
+            munmap(reserved, base - reserved);
+        munmap(base + pages, reserved + ARENA_SIZE - base);
+        base = fd < 0 ? mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)
+                      : mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+        if (base == MAP_FAILED)
+            return NULL;
+        *backing = madvise(base, ARENA_SIZE, MADV_HUGEPAGE) == 0 ? ARENA_THP : ARENA_SMALL_PAGES;
+    }
+
+    // (before the pages are touched, so they are allocated there; a shared segment another
+    // process has touched already stays where it is.)
+    if (numa_node >= 0)
+    {
+        nodes = numa_node < (int)(8 * sizeof(nodes)) ? 1UL << numa_node : 0;
+        if (nodes == 0 ||
+            syscall(SYS_mbind, base, size, MPOL_BIND, &nodes, 8 * sizeof(nodes), 0) < 0)
+            fprintf(stderr, "cache arena: can't place it on NUMA node %d (%s); it goes where it is touched first.\n",
+                    numa_node, strerror(errno));
+    }
+    return base;
+}
+
+// The CPUs of NUMA node numa_node (at most max of them, into cpus), as the kernel lists them
+// in sysfs. Returns how many there are, or -1 if there is no such node.
+int arena_node_cpus(int numa_node, int *cpus, int max)
+{
+    char path[64];
+    FILE *in;
+    int first, last, n = 0;
+    char sep;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", numa_node);
+    if ((in = fopen(path, "r")) == NULL)
+        return -1;
+    // e.g. "0-7,16-23"
+    while (fscanf(in, "%d", &first) == 1)
+    {
+        last = first;
+        sep = fgetc(in);
+        if (sep == '-' && fscanf(in, "%d", &last) == 1)
+            sep = fgetc(in);
+        for (; first <= last && n < max; first++)
+            cpus[n++] = first;
+        if (sep != ',')
+            break;
+    }
+    fclose(in);
+    return n;
+}
@@ -0,0 +1,46 @@
+/*
+The memory the cache keeps its entries in: an arena of 4MB, mapped on its own and handed out
+in power-of-two chunks (a buddy allocator). That is two huge pages, and the arena is aligned to
+them, so where the system has huge pages (hugetlbfs, or transparent ones) everything cached is
+reached through two TLB entries, instead of one per 4KB page of a heap that small mallocs are
+scattered across: a hit, which walks blocks, keys and a body, doesn't miss the TLB.
+Chunks are named by their offset into the arena, so the bookkeeping (arena_chunks) works as
+well in an arena that is mapped at a different address in every process (see shmcache.h).
+ */
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_ORDER 22     // 4MB of chunks: room for MAX_CACHE_SIZE, even if every chunk is half empty
+                           // and every entry is small (its block and keys are chunks of their own)
+#define ARENA_MIN_ORDER 6  // smallest chunk: 64 bytes
+#define ARENA_SIZE ((size_t)1 << ARENA_ORDER)
+#define ARENA_ORDERS (ARENA_ORDER + 1)
+#define ARENA_NIL UINT32_MAX // "no chunk"
+#define ARENA_IN_USE 0x80    // (in chunk_order)
+
+// How an arena's memory is backed (see arena_map).
+#define ARENA_SMALL_PAGES 0
+#define ARENA_HUGETLB 1    // a huge page reserved for it (vm.nr_hugepages)
+#define ARENA_THP 2        // a transparent huge page, if the kernel has one to give
+
+// Which chunks are free, and of what order. Kept apart from the arena itself (e.g. in the
+// shared segment's header).
+typedef struct arena_chunks
+{
+    uint32_t free_list[ARENA_ORDERS]; // free chunks of each order
+    uint64_t chunk_bytes;             // bytes in chunks that are in use
+    uint8_t chunk_order[ARENA_SIZE >> ARENA_MIN_ORDER]; // of the chunk that starts here: order + 1,
+                                                        // | ARENA_IN_USE if it is in use; 0: none
+} arena_chunks;
+
+char *arena_map(int fd, size_t size, int numa_node, int *backing);
+void arena_chunks_init(arena_chunks *chunks, char *base);
+int arena_order(size_t size);
+uint32_t arena_alloc(arena_chunks *chunks, char *base, int order);
+void arena_free(arena_chunks *chunks, char *base, uint32_t off);
+int arena_node_cpus(int numa_node, int *cpus, int max);
+
+#endif/*ARENA_H*/
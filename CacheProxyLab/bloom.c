@@ -0,0 +1,61 @@
+#include <string.h>
+#include "bloom.h"
+#include "xxhash.h"
+
+#define BLOOM_STUCK 255 // a counter that has overflowed
+
+// The counters key sets: two halves of its xxh64, combined (double hashing).
+static void counters_of(char *key, uint32_t index[BLOOM_HASHES])
+{
+    uint64_t h = xxh64(key, strlen(key));
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+    int i;
+
+    for (i = 0; i < BLOOM_HASHES; i++)
+        index[i] = (h1 + i * h2) & (BLOOM_COUNTERS - 1);
+}
+
+// Caller holds the cache's write lock.
+void bloom_add(uint8_t *counters, char *key)
+{
+    uint32_t index[BLOOM_HASHES];
+    uint8_t c;
+    int i;
+
+    counters_of(key, index);
+    for (i = 0; i < BLOOM_HASHES; i++)
+    {
+        c = __atomic_load_n(&counters[index[i]], __ATOMIC_RELAXED);
+        if (c != BLOOM_STUCK)
+            __atomic_store_n(&counters[index[i]], c + 1, __ATOMIC_RELAXED);
+    }
+}
+
+// key must have been added (and not removed since). Caller holds the cache's write lock.
+void bloom_remove(uint8_t *counters, char *key)
+{
+    uint32_t index[BLOOM_HASHES];
+    uint8_t c;
+    int i;
+
+    counters_of(key, index);
+    for (i = 0; i < BLOOM_HASHES; i++)
+    {
+        c = __atomic_load_n(&counters[index[i]], __ATOMIC_RELAXED);
+        if (c != BLOOM_STUCK && c > 0)
+            __atomic_store_n(&counters[index[i]], c - 1, __ATOMIC_RELAXED);
+    }
+}
+
+// 0: key is certainly not in the cache; 1: it may be. Needs no lock.
+int bloom_may_have(uint8_t *counters, char *key)
+{
+    uint32_t index[BLOOM_HASHES];
+    int i;
+
+    counters_of(key, index);
+    for (i = 0; i < BLOOM_HASHES; i++)
+        if (__atomic_load_n(&counters[index[i]], __ATOMIC_RELAXED) == 0)
+            return 0;
+    return 1;
+}
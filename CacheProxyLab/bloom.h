@@ -0,0 +1,25 @@
+/*
+A counting Bloom filter of the request lines in the cache, checked before a lookup takes the
+cache's lock: most URLs are asked for once, and are certainly not cached, which the filter
+says without a lock (and without walking the cache). A request line sets BLOOM_HASHES of
+BLOOM_COUNTERS counters (picked by its xxh64); it may be cached only if all of them are
+non-zero. Counters, not bits, so that an evicted entry can be taken out again: a counter
+that reaches 255 stays there (it can't tell how many there were any more), which only costs
+false positives.
+The counters are changed only by the cache's writers (who hold its write lock), one byte at
+a time, and read without any lock: a lookup racing with an insert may miss on a response that
+was cached a moment ago, as it would have if it had come a moment earlier.
+ */
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdint.h>
+
+#define BLOOM_COUNTERS 65536 // (a power of two) with BLOOM_HASHES 4: ~0.1% false positives at 3000 entries
+#define BLOOM_HASHES 4
+
+void bloom_add(uint8_t *counters, char *key);
+void bloom_remove(uint8_t *counters, char *key);
+int bloom_may_have(uint8_t *counters, char *key);
+
+#endif/*BLOOM_H*/
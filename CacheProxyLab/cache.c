@@ -4,14 +4,101 @@
 #include "cache.h"
 #include "string.h"
 #include "proxy.h"
+#include "http.h"
+#include "compress.h"
+#include "io.h"
+#include "shmcache.h"
+#include "xxhash.h"
+#include "arena.h"
+#include "bloom.h"
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <regex.h>
 
 // head.Previous is the tail of the list.
 // Previous is also used, when removing the tail (because of LRU), then we need to make head.prev the new tail.
 cache_block *head;
 
-void init_cache()
+// Totals over all cached blocks: how many, and how big their responses are uncompressed
+// (head->size is what they actually take up).
+static unsigned long entries = 0;
+static size_t original_bytes = 0;
+
+// Bodies by hash (see cache_body); how many blocks point to a body another block has too,
+// and the bytes that saves.
+#define BODY_BUCKETS 1024
+static cache_body *bodies[BODY_BUCKETS];
+static unsigned long dedup_blocks = 0;
+static size_t dedup_saved = 0;
+
+// Bans (see cache_ban), newest first: responses cached before a ban, for URLs that match it, are stale.
+// Each has a sequence number (ban_seq: how many bans there have been), so that a block is only
+// checked against the bans added since it was cached.
+typedef struct ban
+{
+    unsigned long seq;
+    int is_regex;
+    char *prefix; // (if not is_regex)
+    regex_t regex;
+    struct ban *next;
+} ban;
+static ban *bans = NULL;
+static int ban_count = 0;
+static unsigned long ban_seq = 0;
+
+// The arena (see arena.h) the private cache keeps its blocks, keys and bodies in, how it is
+// backed (ARENA_*), and how many allocations didn't fit in it (when it is crumbled) and were malloc'd.
+static char *heap = NULL;
+static arena_chunks heap_chunks;
+static int heap_backing;
+static unsigned long heap_spilled = 0;
+static int numa_node = -1;
+
+// The request lines in the cache (see bloom.h): this process' own, or the shared cache's; and
+// how many lookups it was asked about, and how many of those it answered alone (see cache_may_have).
+static uint8_t own_filter[BLOOM_COUNTERS];
+static uint8_t *filter = own_filter;
+static unsigned long filter_checks = 0;
+static unsigned long filter_skips = 0;
+
+// Name of the shared cache (see cache_share) in use instead of the list above; NULL: none.
+// The blocks handed out for it are views, one per thread, valid while the caller holds the lock.
+static char *shared = NULL;
+static __thread cache_block view;
+
+// Memory for something cached: a chunk of the arena if one is free, malloc'd memory otherwise.
+// NULL if there is none.
+static void *cache_alloc(size_t size)
+{
+    uint32_t off = heap != NULL ? arena_alloc(&heap_chunks, heap, arena_order(size)) : ARENA_NIL;
+
+    if (off != ARENA_NIL)
+        return heap + off;
+    heap_spilled++;
+    return malloc(size);
+}
+
+static void cache_free(void *p)
+{
+    if (heap != NULL && (char *)p >= heap && (char *)p < heap + ARENA_SIZE)
+        arena_free(&heap_chunks, heap, (char *)p - heap);
+    else
+        free(p);
+}
+
+// Set up an empty cache. Its memory is taken from NUMA node node (-1: wherever it is touched first).
+void init_cache(int node)
 {
-    cache_block *start_cache = malloc(sizeof(cache_block));
+    cache_block *start_cache;
+
+    numa_node = node;
+    if ((heap = arena_map(-1, ARENA_SIZE, numa_node, &heap_backing)) != NULL)
+        arena_chunks_init(&heap_chunks, heap);
+
+    start_cache = cache_alloc(sizeof(cache_block));
     if (start_cache == NULL)
     {
         fprintf(stderr, "Error: Failed to initialize the cache.\n");
@@ -20,63 +107,215 @@ void init_cache()
 
     // Head is a header node with no payload.
     start_cache->request_header = NULL;
-    start_cache->content = NULL;
+    start_cache->vary = NULL;
+    start_cache->variant_key = NULL;
+    start_cache->response_header = NULL;
+    start_cache->header_len = 0;
+    start_cache->body = NULL;
+    start_cache->body_ref = NULL;
     start_cache->prev = start_cache;
     start_cache->next = start_cache;
     start_cache->size = 0;
+    start_cache->mapped = 0;
 
     head = start_cache;
 }
 
-void insert_head(char *header, char *content, size_t size)
+// Use the cache in the shared-memory segment called name (created if there is none) instead of
+// this process' own list, so that all proxies naming it share their cached responses.
+// Returns 0 (from then on, the lock is the segment's; see shmcache.h), or -1 if it can't be had.
+// *created says whether the segment was new (and so empty).
+int cache_share(char *name, int *created)
 {
-    cache_block *new_block;
+    if (shm_cache_attach(name, numa_node, created, &heap_backing) < 0)
+        return -1;
+    shared = name;
+    filter = shm_cache_filter();
+    return 0;
+}
+
+// The lock that guards the cache: readers (lookups) share it, a writer has it alone. Callers
+// hold it around every call below that says so (the blocks handed out are valid while they do).
+// (With a shared cache, the segment's, which all proxies sharing it take.)
+static pthread_rwlock_t own_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+void cache_rdlock()
+{
+    if (shared != NULL)
+        shm_cache_rdlock();
+    else
+        pthread_rwlock_rdlock(&own_lock);
+}
+
+void cache_wrlock()
+{
+    if (shared != NULL)
+        shm_cache_wrlock();
+    else
+        pthread_rwlock_wrlock(&own_lock);
+}
+
+void cache_unlock()
+{
+    if (shared != NULL)
+        shm_cache_unlock();
+    else
+        pthread_rwlock_unlock(&own_lock);
+}
 
-    if ((new_block = malloc(sizeof(cache_block))) == NULL)
+static char *copy_string(char *s)
+{
+    char *copy;
+    if (s == NULL)
+        return NULL;
+    if ((copy = cache_alloc(strlen(s) + 1)) == NULL)
     {
         fprintf(stderr, "allocate failed\n");
         exit(EXIT_FAILURE);
     }
+    return strcpy(copy, s);
+}
 
-    if ((new_block->content = malloc(size)) == NULL)
+void insert_head(char *header, char *content, size_t size)
+{
+    size_t header_len = response_header_length(content, size);
+    insert_variant(header, NULL, NULL, content, size, size, CACHE_IDENTITY,
+                   xxh64(content + header_len, size - header_len));
+}
+
+// The body with these len bytes (and this hash), with one more block pointing to it:
+// the one cached already, if there is one; otherwise a copy.
+static cache_body *get_body(char *data, size_t len, uint64_t hash)
+{
+    cache_body *body;
+    cache_body **bucket = &bodies[hash % BODY_BUCKETS];
+
+    for (body = *bucket; body != NULL; body = body->next)
+    {
+        if (body->hash == hash && body->len == len && !memcmp(body->data, data, len))
+        {
+            body->refs++;
+            dedup_blocks++;
+            dedup_saved += len;
+            return body;
+        }
+    }
+
+    // (the bytes follow the bookkeeping, in the same allocation)
+    if ((body = cache_alloc(sizeof(cache_body) + len)) == NULL)
     {
         fprintf(stderr, "allocate failed\n");
         exit(EXIT_FAILURE);
     }
+    body->hash = hash;
+    body->len = len;
+    body->refs = 1;
+    body->mapped = 0;
+    body->data = (char *)(body + 1);
+    memcpy(body->data, data, len); // responses are binary; they may contain '\0'.
+    body->next = *bucket;
+    *bucket = body;
+    return body;
+}
+
+// A body in a restored snapshot. It isn't hashed (that would page in every body now, see
+// cache_restore), so it is never shared.
+static cache_body *mapped_body(char *data, size_t len)
+{
+    cache_body *body;
 
-    if ((new_block->request_header = malloc(strlen(header) + 1)) == NULL) // +1 for the null terminator
+    if ((body = cache_alloc(sizeof(cache_body))) == NULL)
     {
         fprintf(stderr, "allocate failed\n");
         exit(EXIT_FAILURE);
     }
+    body->hash = 0;
+    body->len = len;
+    body->refs = 1;
+    body->mapped = 1;
+    body->data = data;
+    body->next = NULL;
+    return body;
+}
 
-    size_t header_size = strlen(header) + 1; // +1 for the null terminator
-    strncpy(new_block->request_header, header, header_size);
-    strncpy(new_block->content, content, size);
+// One block fewer pointing to body; the last one frees it.
+static void put_body(cache_body *body)
+{
+    cache_body **link;
 
-    new_block->size = size;
+    if (--body->refs > 0)
+    {
+        dedup_blocks--;
+        dedup_saved -= body->len;
+        return;
+    }
+    if (!body->mapped)
+    {
+        for (link = &bodies[body->hash % BODY_BUCKETS]; *link != body; link = &(*link)->next)
+            ;
+        *link = body->next;
+    }
+    cache_free(body);
+}
+
+// Bytes the block takes up: its header, and its body unless another block points to that too.
+static size_t block_bytes(cache_block *block)
+{
+    return block->header_len + (block->body_ref->refs == 1 ? block->body_ref->len : 0);
+}
+
+static void free_block(cache_block *block)
+{
+    if (!block->mapped)
+    {
+        cache_free(block->response_header);
+        cache_free(block->request_header);
+        cache_free(block->vary);
+        cache_free(block->variant_key);
+    }
+    put_body(block->body_ref);
+    cache_free(block);
+}
+
+// Take block out of the list, and free it.
+static void remove_block(cache_block *block)
+{
+    (block->next)->prev = block->prev;
+    (block->prev)->next = block->next;
+
+    head->size = head->size - block_bytes(block);
+    original_bytes -= block->original_size;
+    entries--;
+    bloom_remove(filter, block->request_header);
+
+    free_block(block);
+}
+
+// Put a new block at the head of the list, evicting least recently used blocks to make room.
+static void link_block(cache_block *new_block)
+{
+    // (what it takes up counts its body only if no other block has that: evicting one that
+    // does, below, leaves the body to new_block, already counted.)
+    size_t new_bytes = block_bytes(new_block);
 
     // Evict LRU (Least recently used), which is the end of the list
-    int shouldEvict = MAX_CACHE_SIZE < head->size + size;
+    int shouldEvict = MAX_CACHE_SIZE < head->size + new_bytes;
     while (shouldEvict)
     {
         cache_block *tail = head->prev;
 
         if (tail == head)
         {
+            free_block(new_block); // too big for the cache, even empty.
             return;
         }
 
-        (tail->next)->prev = tail->prev;
-        (tail->prev)->next = tail->next;
-
-        head->size = head->size - tail->size;
-
-        free(tail->content);
-        free(tail->request_header);
-        free(tail);
-        shouldEvict = MAX_CACHE_SIZE < head->size + size;
+        remove_block(tail);
+        shouldEvict = MAX_CACHE_SIZE < head->size + new_bytes;
     }
+    new_block->hits = 0;
+    new_block->bans_seen = ban_seq;
+
     // insert new cache entry to front of the list
     new_block->next = head->next;
     new_block->prev = head;
@@ -84,7 +323,76 @@ void insert_head(char *header, char *content, size_t size)
     (head->next)->prev = new_block;
     head->next = new_block;
     // update size in head
-    head->size += size;
+    head->size += new_bytes;
+    original_bytes += new_block->original_size;
+    entries++;
+    bloom_add(filter, new_block->request_header);
+}
+
+// Insert a response that varies (per its Vary field names `vary`) on the request fields
+// summarized by variant_key. All variants of a request line are separate blocks with the
+// same request_header, each evicted on its own.
+// content is stored as-is (size bytes); original_size and encoding say what it was before (see compress.h).
+// Its body (what follows the response header) is stored once for all blocks with the same body:
+// body_hash is xxh64 of it (see xxhash.h; the proxy hashes it as it arrives).
+void insert_variant(char *header, char *vary, char *variant_key, char *content, size_t size,
+                    size_t original_size, int encoding, uint64_t body_hash)
+{
+    cache_block *new_block;
+    size_t header_len;
+
+    if (shared != NULL)
+    {
+        shm_cache_insert(header, vary, variant_key, content, size, original_size, encoding);
+        return;
+    }
+
+    // The same response may be in already (fetched by two requests at once, or banned, see
+    // cache_ban): the new one replaces it. (Taken out first, so a body it shares is counted once.)
+    for (new_block = head->next; new_block != head; new_block = new_block->next)
+    {
+        if (!strcmp(header, new_block->request_header) &&
+            !strcmp(variant_key != NULL ? variant_key : "", new_block->variant_key != NULL ? new_block->variant_key : ""))
+        {
+            remove_block(new_block);
+            break;
+        }
+    }
+
+    if ((new_block = cache_alloc(sizeof(cache_block))) == NULL)
+    {
+        fprintf(stderr, "allocate failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    header_len = response_header_length(content, size);
+    if ((new_block->response_header = cache_alloc(header_len + 1)) == NULL) // (+1: a response may have no header)
+    {
+        fprintf(stderr, "allocate failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((new_block->request_header = cache_alloc(strlen(header) + 1)) == NULL) // +1 for the null terminator
+    {
+        fprintf(stderr, "allocate failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t header_size = strlen(header) + 1; // +1 for the null terminator
+    strncpy(new_block->request_header, header, header_size);
+    memcpy(new_block->response_header, content, header_len);
+    new_block->header_len = header_len;
+    new_block->body_ref = get_body(content + header_len, size - header_len, body_hash);
+    new_block->body = new_block->body_ref->data;
+    new_block->vary = copy_string(vary);
+    new_block->variant_key = copy_string(variant_key);
+
+    new_block->size = size;
+    new_block->original_size = original_size;
+    new_block->encoding = encoding;
+    new_block->mapped = 0;
+
+    link_block(new_block);
 }
 
 // Used for putting a recently used block to the front, as to protect it from eviction
@@ -96,6 +404,13 @@ void move_to_head(cache_block *entry)
         exit(EXIT_FAILURE);
     }
 
+    entry->hits++;
+    if (shared != NULL)
+    {
+        shm_cache_touch(entry);
+        return;
+    }
+
     // Already at the front
     if (entry->prev == head)
         return;
@@ -130,3 +445,509 @@ cache_block *find(char *request)
     }
     return NULL;
 }
+
+// Whether a response for request (a request line) may be cached: 0 if it certainly isn't, so
+// there is no need to take the cache's lock and look. Needs no lock.
+int cache_may_have(char *request)
+{
+    __atomic_fetch_add(&filter_checks, 1, __ATOMIC_RELAXED);
+    if (bloom_may_have(filter, request))
+        return 1;
+    __atomic_fetch_add(&filter_skips, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Whether block (one for the request line asked for) is the variant for the request header fields
+// (of length len): it is if the request agrees with it on every field its response's Vary named;
+// blocks without Vary match any request.
+static int is_variant(cache_block *block, char *request_fields, size_t len)
+{
+    char key_storage[MAX_LINE];
+    strbuf key;
+
+    if (block->vary == NULL)
+        return 1;
+    strbuf_init(&key, key_storage, sizeof(key_storage));
+    return set_variant_key(&key, block->vary, request_fields, len) && !strcmp(key.data, block->variant_key);
+}
+
+// The URL in a request line ("GET <url> HTTP/1.x"), and its length (*len).
+static char *request_url(char *request, size_t *len)
+{
+    char *url = strchr(request, ' ');
+
+    url = url != NULL ? url + 1 : request;
+    *len = strcspn(url, " \r\n");
+    return url;
+}
+
+// Whether the request line (the key of a block) is for a URL that ban b bans.
+static int ban_matches(ban *b, char *request)
+{
+    char url[MAX_LINE];
+    size_t len;
+    char *p = request_url(request, &len);
+
+    if (!b->is_regex)
+        return len >= strlen(b->prefix) && !strncmp(p, b->prefix, strlen(b->prefix));
+    if (len >= sizeof(url))
+        len = sizeof(url) - 1;
+    memcpy(url, p, len);
+    url[len] = '\0';
+    return regexec(&b->regex, url, 0, NULL, 0) == 0;
+}
+
+// Whether a ban added since block was cached bans it (then it is as good as gone: lookups skip
+// it, and the next response cached for it replaces it; see insert_variant). Caller holds (at least)
+// the read lock.
+static int is_banned(cache_block *block)
+{
+    ban *b;
+
+    for (b = bans; b != NULL && b->seq > block->bans_seen; b = b->next)
+    {
+        if (ban_matches(b, block->request_header))
+            return 1;
+    }
+    return 0;
+}
+
+// Find the variant of `request` that matches the request header fields (of length len).
+cache_block *find_variant(char *request, char *request_fields, size_t len)
+{
+    cache_block *current;
+
+    if (shared != NULL)
+    {
+        for (current = shm_cache_lookup(request, &view); current != NULL;
+             current = shm_cache_lookup_next(request, &view))
+        {
+            if (is_variant(current, request_fields, len))
+                return current;
+        }
+        return NULL;
+    }
+
+    for (current = head->next; current != head; current = current->next)
+    {
+        if (strcmp(request, current->request_header))
+            continue;
+        if (is_variant(current, request_fields, len) && !is_banned(current))
+            return current;
+    }
+    return NULL;
+}
+
+// In a shared cache, the entry (in view) has the URL url, or is banned by ban arg (see shm_cache_remove_if).
+static int url_is(cache_block *view, void *url)
+{
+    size_t len;
+    char *p = request_url(view->request_header, &len);
+
+    return len == strlen(url) && !strncmp(p, url, len);
+}
+
+static int banned_by(cache_block *view, void *b)
+{
+    return ban_matches(b, view->request_header);
+}
+
+// Remove every response cached for url (all its variants, whatever HTTP version they were asked in).
+// Returns how many there were. Caller holds the write lock.
+long cache_purge(char *url)
+{
+    cache_block *block, *prev;
+    long removed = 0;
+
+    if (shared != NULL)
+        return shm_cache_remove_if(url_is, url, &view);
+
+    for (block = head->prev; block != head; block = prev)
+    {
+        prev = block->prev;
+        if (url_is(block, url))
+        {
+            remove_block(block);
+            removed++;
+        }
+    }
+    return removed;
+}
+
+static void free_ban(ban *b)
+{
+    if (b->is_regex)
+        regfree(&b->regex);
+    else
+        free(b->prefix);
+    free(b);
+}
+
+// Ban the responses cached so far for URLs that start with pattern (or, if is_regex, that match it,
+// as a POSIX extended regular expression), without going through the cache: a ban is checked when a
+// block is looked up (see is_banned). Only when there are more than MAX_BANS does the cache get rid
+// of everything they ban, all at once; then they go. (A shared cache has no room for bans, as its
+// processes don't share them: it gets rid of what is banned right away.)
+// Returns how many cached responses were removed now, or -1 if pattern isn't a valid regex.
+// Caller holds the write lock.
+long cache_ban(char *pattern, int is_regex)
+{
+    cache_block *block, *prev;
+    ban *b, *next;
+    long removed = 0;
+
+    if ((b = malloc(sizeof(ban))) == NULL)
+    {
+        fprintf(stderr, "allocate failed\n");
+        exit(EXIT_FAILURE);
+    }
+    b->is_regex = is_regex;
+    b->prefix = NULL;
+    if (!is_regex && (b->prefix = strdup(pattern)) == NULL) // (not cache data: not from cache_alloc)
+    {
+        fprintf(stderr, "allocate failed\n");
+        exit(EXIT_FAILURE);
+    }
+    if (is_regex && regcomp(&b->regex, pattern, REG_EXTENDED | REG_NOSUB) != 0)
+    {
+        free(b);
+        return -1;
+    }
+
+    if (shared != NULL)
+    {
+        removed = shm_cache_remove_if(banned_by, b, &view);
+        free_ban(b);
+        return removed;
+    }
+
+    b->seq = ++ban_seq;
+    b->next = bans;
+    bans = b;
+    if (++ban_count <= MAX_BANS)
+        return 0;
+
+    for (block = head->prev; block != head; block = prev)
+    {
+        prev = block->prev;
+        if (is_banned(block))
+        {
+            remove_block(block);
+            removed++;
+        }
+    }
+    for (b = bans; b != NULL; b = next)
+    {
+        next = b->next;
+        free_ban(b);
+    }
+    bans = NULL;
+    ban_count = 0;
+    return removed;
+}
+
+// One line about block, for cache_top and cache_dump.
+static void print_block(FILE *out, cache_block *block)
+{
+    size_t len;
+    char *url = request_url(block->request_header, &len);
+
+    fprintf(out, "%8lu hits %8zu bytes  %.*s", block->hits, block->size, (int)len, url);
+    if (block->vary != NULL)
+        fprintf(out, " (a variant, by %s)", block->vary);
+    if (shared == NULL && is_banned(block))
+        fprintf(out, " (banned)");
+    fprintf(out, "\n");
+}
+
+static int more_hits(const void *a, const void *b)
+{
+    const cache_block *x = a, *y = b;
+    return x->hits < y->hits ? 1 : x->hits > y->hits ? -1 : 0;
+}
+
+static int bigger(const void *a, const void *b)
+{
+    const cache_block *x = a, *y = b;
+    return x->size < y->size ? 1 : x->size > y->size ? -1 : 0;
+}
+
+// Print the n cached responses with the most hits (or, if by_size, the biggest), most first.
+// Caller holds (at least) the read lock.
+void cache_top(FILE *out, int n, int by_size)
+{
+    cache_block *block, *all;
+    unsigned long count = entries, i = 0;
+    size_t stored, original, chunk_bytes;
+
+    if (shared != NULL)
+        shm_cache_stats(&count, &stored, &original, &chunk_bytes);
+    if (count == 0 || (all = malloc(count * sizeof(cache_block))) == NULL)
+        return;
+
+    // (copies: a shared cache's blocks are views, one at a time)
+    if (shared != NULL)
+    {
+        for (block = shm_cache_oldest(&view); block != NULL && i < count; block = shm_cache_newer(&view))
+            all[i++] = *block;
+    }
+    else
+    {
+        for (block = head->next; block != head && i < count; block = block->next)
+            all[i++] = *block;
+    }
+    qsort(all, i, sizeof(cache_block), by_size ? bigger : more_hits);
+    for (count = 0; count < i && count < (unsigned long)n; count++)
+        print_block(out, &all[count]);
+    free(all);
+}
+
+// Print every cached response, in LRU order: the next one to be evicted first.
+// Caller holds (at least) the read lock.
+void cache_dump(FILE *out)
+{
+    cache_block *block;
+
+    if (shared != NULL)
+    {
+        for (block = shm_cache_oldest(&view); block != NULL; block = shm_cache_newer(&view))
+            print_block(out, block);
+        return;
+    }
+    for (block = head->prev; block != head; block = block->prev)
+        print_block(out, block);
+}
+
+static const char *backing_name(int backing)
+{
+    return backing == ARENA_HUGETLB ? "huge page" : backing == ARENA_THP ? "transparent huge page, if given" : "small pages";
+}
+
+// Print how full the cache is, and how much more it holds than its size thanks to compression.
+// Caller holds (at least) the read lock.
+void cache_report(FILE *out)
+{
+    unsigned long n = entries;
+    size_t stored = head->size, original = original_bytes, chunk_bytes;
+
+    if (shared != NULL)
+        shm_cache_stats(&n, &stored, &original, &chunk_bytes);
+    fprintf(out, "cache %lu entries, %zu/%d bytes stored, %zu bytes uncompressed (effective capacity x%.2f)\n",
+            n, stored, MAX_CACHE_SIZE, original, stored ? (double)original / stored : 1.0);
+    fprintf(out, "cache filter: %lu of %lu lookups (%.1f%%) were certain misses, and skipped the lock\n",
+            filter_skips, filter_checks, filter_checks ? 100.0 * filter_skips / filter_checks : 0.0);
+    if (shared == NULL)
+    {
+        fprintf(out, "cache dedup: %lu entries share a body with another, %zu bytes saved\n", dedup_blocks,
+                dedup_saved);
+        fprintf(out, "cache arena: %zu/%zu bytes in use (%s), %lu allocations didn't fit\n",
+                heap != NULL ? (size_t)heap_chunks.chunk_bytes : 0, ARENA_SIZE, backing_name(heap_backing), heap_spilled);
+    }
+    else
+    {
+        fprintf(out, "cache shared in %s: %zu/%zu bytes of the segment's arena in use (%s)\n", shared, chunk_bytes,
+                ARENA_SIZE, backing_name(heap_backing));
+    }
+}
+
+// Write one block's record (see cache.h) to fd. Returns 0, or -1 if the write failed.
+static int save_block(int fd, cache_block *block)
+{
+    cache_record record;
+    struct iovec iov[6];
+
+    memset(&record, 0, sizeof(record));
+    record.size = block->size;
+    record.original_size = block->original_size;
+    record.header_len = strlen(block->request_header);
+    record.vary_len = block->vary != NULL ? strlen(block->vary) : 0;
+    record.key_len = block->variant_key != NULL ? strlen(block->variant_key) : 0;
+    record.encoding = block->encoding;
+
+    // the strings go with their '\0' (an absent one as ""), so a mapped snapshot can be used in place.
+    iov[0].iov_base = &record;
+    iov[0].iov_len = sizeof(record);
+    iov[1].iov_base = block->request_header;
+    iov[1].iov_len = record.header_len + 1;
+    iov[2].iov_base = block->vary != NULL ? block->vary : "";
+    iov[2].iov_len = record.vary_len + 1;
+    iov[3].iov_base = block->variant_key != NULL ? block->variant_key : "";
+    iov[3].iov_len = record.key_len + 1;
+    iov[4].iov_base = block->response_header;
+    iov[4].iov_len = block->header_len;
+    iov[5].iov_base = block->body;
+    iov[5].iov_len = block->size - block->header_len;
+    return writev_all(fd, iov, 6) < 0 ? -1 : 0;
+}
+
+// Write a snapshot of the cache (see cache.h) to fd. Returns 0, or -1 if a write failed.
+// Caller holds (at least) the read lock.
+int cache_save(int fd)
+{
+    cache_block *current;
+
+    if (write_all(fd, CACHE_SNAPSHOT_MAGIC, strlen(CACHE_SNAPSHOT_MAGIC)) < 0)
+        return -1;
+
+    // least recently used first, so that loading it (inserting each at the head) keeps the order.
+    if (shared != NULL)
+    {
+        for (current = shm_cache_oldest(&view); current != NULL; current = shm_cache_newer(&view))
+        {
+            if (save_block(fd, current) < 0)
+                return -1;
+        }
+        return 0;
+    }
+    for (current = head->prev; current != head; current = current->prev)
+    {
+        if (save_block(fd, current) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Read a snapshot written by cache_save from fd (until EOF), into the cache.
+// Returns the number of blocks loaded, or -1 if the snapshot is broken (the blocks before that are kept).
+long cache_load(int fd)
+{
+    char magic[sizeof(CACHE_SNAPSHOT_MAGIC) - 1];
+    cache_record record;
+    char header[MAX_LINE];
+    char vary[MAX_LINE];
+    char variant_key[MAX_LINE];
+    char *content;
+    size_t header_len;
+    ssize_t n;
+    long loaded = 0;
+
+    if (read_all(fd, magic, sizeof(magic)) <= 0 || memcmp(magic, CACHE_SNAPSHOT_MAGIC, sizeof(magic)))
+        return -1;
+
+    while ((n = read_all(fd, &record, sizeof(record))) > 0)
+    {
+        if (record.header_len >= MAX_LINE || record.vary_len >= MAX_LINE || record.key_len >= MAX_LINE ||
+            record.size > MAX_OBJECT_SIZE)
+            return -1;
+        if ((content = malloc(record.size)) == NULL)
+        {
+            fprintf(stderr, "allocate failed\n");
+            exit(EXIT_FAILURE);
+        }
+        if (read_all(fd, header, record.header_len + 1) != record.header_len + 1 ||
+            read_all(fd, vary, record.vary_len + 1) != record.vary_len + 1 ||
+            read_all(fd, variant_key, record.key_len + 1) != record.key_len + 1 ||
+            read_all(fd, content, record.size) != record.size)
+        {
+            free(content);
+            return -1;
+        }
+        header[record.header_len] = '\0';
+        vary[record.vary_len] = '\0';
+        variant_key[record.key_len] = '\0';
+
+        header_len = response_header_length(content, record.size);
+        insert_variant(header, record.vary_len ? vary : NULL, record.vary_len ? variant_key : NULL,
+                       content, record.size, record.original_size, record.encoding,
+                       xxh64(content + header_len, record.size - header_len));
+        free(content);
+        loaded++;
+    }
+    return n < 0 ? -1 : loaded;
+}
+
+// Write a snapshot of the cache to the file at path (replacing it atomically: a snapshot that
+// is mapped, see cache_restore, is never overwritten). Returns 0, or -1.
+// Caller holds (at least) the read lock.
+int cache_snapshot(char *path)
+{
+    char tmp_path[MAX_LINE];
+    int fd, return_cd;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+        return -1;
+    return_cd = cache_save(fd);
+    if (close(fd) < 0 || return_cd < 0 || rename(tmp_path, path) < 0)
+    {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Fill the (empty) cache from the snapshot file at path. The file is mapped, not read: blocks
+// point into the mapping (see cache_block.mapped), so only the record and response headers are
+// touched now, and a body is only paged in when it is first served (see mapped_body).
+// Returns the number of blocks restored (those before a broken record, if any), or -1.
+long cache_restore(char *path)
+{
+    int fd;
+    struct stat st;
+    char *map, *p, *end;
+    cache_record record;
+    cache_block *block;
+    long restored = 0;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    // (a shared cache can't point into a private mapping: the snapshot is copied into it.)
+    if (shared != NULL)
+    {
+        restored = cache_load(fd);
+        close(fd);
+        return restored;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)strlen(CACHE_SNAPSHOT_MAGIC))
+    {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping stays.
+    if (map == MAP_FAILED)
+        return -1;
+    if (memcmp(map, CACHE_SNAPSHOT_MAGIC, strlen(CACHE_SNAPSHOT_MAGIC)))
+    {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    // (the mapping is never unmapped: evicted blocks' bytes simply aren't looked at again.)
+    end = map + st.st_size;
+    for (p = map + strlen(CACHE_SNAPSHOT_MAGIC); end - p >= (ptrdiff_t)sizeof(record); restored++)
+    {
+        memcpy(&record, p, sizeof(record));
+        p += sizeof(record);
+        if ((size_t)(end - p) < (size_t)record.header_len + record.vary_len + record.key_len + 3 + record.size ||
+            record.size > MAX_OBJECT_SIZE ||
+            p[record.header_len] != '\0' ||
+            p[record.header_len + 1 + record.vary_len] != '\0' ||
+            p[record.header_len + 1 + record.vary_len + 1 + record.key_len] != '\0')
+            break;
+
+        if ((block = cache_alloc(sizeof(cache_block))) == NULL)
+        {
+            fprintf(stderr, "allocate failed\n");
+            exit(EXIT_FAILURE);
+        }
+        block->request_header = p;
+        p += record.header_len + 1;
+        block->vary = record.vary_len ? p : NULL;
+        p += record.vary_len + 1;
+        block->variant_key = record.vary_len ? p : NULL;
+        p += record.key_len + 1;
+        block->response_header = p;
+        block->header_len = response_header_length(p, record.size);
+        block->body_ref = mapped_body(p + block->header_len, record.size - block->header_len);
+        block->body = block->body_ref->data;
+        p += record.size;
+
+        block->size = record.size;
+        block->original_size = record.original_size;
+        block->encoding = record.encoding;
+        block->mapped = 1;
+        link_block(block);
+    }
+    return restored;
+}
@@ -2,20 +2,82 @@
 A threadsafe linked-list implementation of a cache
  */
 
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
 // Todo - can this be removed by importing from proxy.h?
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
+#define MAX_BANS 32 // bans checked on lookup at most; with one more, the cache is rid of what they ban, and they go
+
+/* A body cached for one or more blocks: byte-identical bodies (of different request lines,
+   or variants) are stored once, found by their hash (see insert_variant). */
+typedef struct cache_body
+{
+    uint64_t hash;            // xxh64 of the bytes (see xxhash.h)
+    size_t len;
+    unsigned long refs;       // blocks that point to it
+    int mapped;               // 1: data points into a restored snapshot (not to be freed; never shared)
+    char *data;
+    struct cache_body *next;  // next body with the same hash bucket
+} cache_body;
 
 typedef struct cache_block
 {
-    char *request_header;
-    char *content;
-    size_t size;
+    char *request_header; // primary key: the request line
+    char *vary;           // field names in the response's Vary header (NULL if it had none)
+    char *variant_key;    // secondary key: the request's values of those fields (see set_variant_key)
+    char *response_header; // the response's header, as the origin sent it (header_len bytes)
+    size_t header_len;
+    char *body;           // the response's body (size - header_len bytes), as stored (see encoding)
+    cache_body *body_ref; // the body's bookkeeping (NULL in a view of a shared cache's entry)
+    size_t size;          // bytes stored (header and body)
+    size_t original_size; // bytes of the response as the origin sent it (differs if compressed)
+    int encoding;         // how the body is stored: CACHE_IDENTITY or CACHE_GZIP (compress.h)
+    int mapped;           // 1: the strings and response header point into a restored snapshot (not to be freed)
+    size_t entry;         // in a shared cache (see cache_share): the entry this block is a view of
+    unsigned long hits;   // times it was served (since it was cached)
+    unsigned long bans_seen; // bans there were when it was cached: only later ones apply to it (see cache_ban)
     struct cache_block *prev;
     struct cache_block *next;
 } cache_block;
 
-void init_cache();
+/* A snapshot of the cache, as saved to a file or passed to the new process on a hot restart:
+   CACHE_SNAPSHOT_MAGIC, then per block, least recently used first, this header (packed, host
+   byte order) followed by the request line, vary and variant key (each with a '\0' after it;
+   vary_len 0: no Vary) and the content. */
+#define CACHE_SNAPSHOT_MAGIC "PXYCACH2" // first 8 bytes of every snapshot
+
+typedef struct __attribute__((packed)) cache_record
+{
+    uint32_t size;          // bytes of content
+    uint32_t original_size; // see cache_block
+    uint16_t header_len;
+    uint16_t vary_len;
+    uint16_t key_len;
+    uint8_t encoding;
+    uint8_t reserved;
+} cache_record;
+
+void init_cache(int numa_node);
+int cache_share(char *name, int *created);
+void cache_rdlock();
+void cache_wrlock();
+void cache_unlock();
 void insert_head(char *request_header, char *content, size_t size);
+void insert_variant(char *request_header, char *vary, char *variant_key, char *content, size_t size,
+                    size_t original_size, int encoding, uint64_t body_hash);
 void move_to_head(cache_block *block);
-cache_block *find(char *request_header);
\ No newline at end of file
+int cache_may_have(char *request_header);
+cache_block *find(char *request_header);
+cache_block *find_variant(char *request_header, char *request_fields, size_t len);
+void cache_report(FILE *out);
+long cache_purge(char *url);
+long cache_ban(char *pattern, int is_regex);
+void cache_top(FILE *out, int n, int by_size);
+void cache_dump(FILE *out);
+int cache_save(int fd);
+long cache_load(int fd);
+int cache_snapshot(char *path);
+long cache_restore(char *path);
@@ -0,0 +1,275 @@
+/*
+A trace-driven, offline simulator of the proxy's cache, for sizing it without live traffic.
+
+Replays an access trace, one request per line:
+
+    <timestamp> <size> <request line>
+
+(e.g. `1697712000.25 5120 GET http://example.com/ HTTP/1.0`; see log2trace), and prints
+the hit ratio the cache would have had at many different sizes, all in one pass:
+for LRU, an object is resident at capacity C exactly when the bytes of the distinct
+objects used since its last use, plus its own size, fit in C (Mattson's stack
+distance, weighted by object size). Stack distances are computed with a Fenwick
+tree over access positions, so a pass is O(n log n).
+
+The same trace is also replayed through the proxy's own cache.c (cache_may_have /
+find / move_to_head / insert_head) at MAX_CACHE_SIZE, as a cross-check of the analysis, timing its
+hits (the cache's part of a hit's latency) as it goes.
+
+usage: ./cachesim [-m min_size] [-M max_size] [-k points] <trace>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include "cache.h"
+
+#define TRACE_LINE 8192
+#define DEFAULT_POINTS 24
+
+typedef struct request
+{
+    char *key;
+    size_t size;
+} request;
+
+typedef struct object
+{
+    char *key;
+    long last; // position of the last access to it (-1: empty slot)
+    size_t size;
+} object;
+
+static request *trace;
+static long n_trace = 0;
+
+static object *objects; // open-addressing hash table, keyed by request line
+static long n_slots;
+
+static long long *fenwick; // fenwick[i]: bytes of objects whose last access is at i (prefix sums)
+
+static unsigned long hash_key(const char *key)
+{
+    unsigned long h = 1469598103934665603ul; // FNV-1a
+    for (; *key; key++)
+        h = (h ^ (unsigned char)*key) * 1099511628211ul;
+    return h;
+}
+
+static object *lookup(char *key)
+{
+    long i = hash_key(key) % n_slots;
+    while (objects[i].key != NULL && strcmp(objects[i].key, key))
+        i = (i + 1) % n_slots;
+    return &objects[i];
+}
+
+static void fenwick_add(long i, long long delta)
+{
+    for (i++; i <= n_trace; i += i & -i)
+        fenwick[i] += delta;
+}
+
+// Sum of fenwick[0..i]
+static long long fenwick_sum(long i)
+{
+    long long sum = 0;
+    for (i++; i > 0; i -= i & -i)
+        sum += fenwick[i];
+    return sum;
+}
+
+static void read_trace(FILE *in)
+{
+    char line[TRACE_LINE];
+    long cap = 1024;
+    double timestamp;
+    size_t size;
+    int offset;
+
+    trace = malloc(cap * sizeof(request));
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        if (sscanf(line, "%lf %zu %n", &timestamp, &size, &offset) < 2)
+            continue; // not an access; skip it.
+        line[strcspn(line, "\r\n")] = '\0';
+        if (n_trace == cap)
+        {
+            cap *= 2;
+            trace = realloc(trace, cap * sizeof(request));
+        }
+        trace[n_trace].key = strdup(line + offset);
+        trace[n_trace].size = size;
+        n_trace++;
+    }
+}
+
+static int compare_distance(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Replay the trace through cache.c itself, at its compiled-in MAX_CACHE_SIZE.
+// *hit_ns: the average time a hit took (its lookup, and moving it to the head).
+static double replay_cache_c(long *hits_out, double *hit_ns)
+{
+    char *content = calloc(MAX_OBJECT_SIZE, 1);
+    cache_block *block;
+    long i, hits = 0;
+    long long start, hit_time = 0;
+
+    init_cache(-1);
+    for (i = 0; i < n_trace; i++)
+    {
+        start = now_ns();
+        if (cache_may_have(trace[i].key) && (block = find(trace[i].key)) != NULL) // (as the proxy looks)
+        {
+            move_to_head(block);
+            hit_time += now_ns() - start;
+            hits++;
+        }
+        else if (trace[i].size < MAX_OBJECT_SIZE) // the proxy only caches objects below this size
+        {
+            // (a body of its own: the cache stores byte-identical bodies once)
+            memcpy(content, &i, sizeof(i));
+            insert_head(trace[i].key, content, trace[i].size);
+        }
+    }
+    free(content);
+    *hits_out = hits;
+    *hit_ns = hits ? (double)hit_time / hits : 0.0;
+    return n_trace ? (double)hits / n_trace : 0.0;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in;
+    object *o;
+    long i, j, n_dist = 0, hits, cache_c_hits;
+    double cache_c_ratio, hit_ns;
+    long long *distance, total_bytes = 0, hit_bytes;
+    size_t *distance_size;
+    long long min_size = 64 * 1024, max_size = 64 * 1024 * 1024, capacity;
+    int points = DEFAULT_POINTS, opt, p;
+
+    while ((opt = getopt(argc, argv, "m:M:k:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            min_size = atoll(optarg);
+            break;
+        case 'M':
+            max_size = atoll(optarg);
+            break;
+        case 'k':
+            points = atoi(optarg);
+            break;
+        default:
+            optind = argc; // print usage
+        }
+    }
+    if (argc - optind != 1 || min_size <= 0 || max_size < min_size || points < 1)
+    {
+        fprintf(stderr, "usage: %s [-m min_size] [-M max_size] [-k points] <trace>\n", argv[0]);
+        exit(1);
+    }
+    if ((in = fopen(argv[optind], "r")) == NULL)
+    {
+        perror(argv[optind]);
+        exit(1);
+    }
+    read_trace(in);
+    fclose(in);
+
+    n_slots = 2 * n_trace + 1;
+    objects = calloc(n_slots, sizeof(object));
+    fenwick = calloc(n_trace + 1, sizeof(long long));
+    distance = malloc((n_trace + 1) * sizeof(long long));
+    distance_size = malloc((n_trace + 1) * sizeof(size_t));
+
+    /* One pass: the stack distance of each re-access. */
+    for (i = 0; i < n_trace; i++)
+    {
+        total_bytes += trace[i].size;
+        if (trace[i].size >= MAX_OBJECT_SIZE)
+            continue; // never cached; a miss at every size.
+
+        o = lookup(trace[i].key);
+        if (o->key != NULL)
+        {
+            // bytes of distinct objects used since o's last access, plus o itself (at its new size).
+            distance[n_dist] = fenwick_sum(i - 1) - fenwick_sum(o->last) + trace[i].size;
+            distance_size[n_dist] = trace[i].size;
+            n_dist++;
+            fenwick_add(o->last, -(long long)o->size);
+        }
+        else
+        {
+            o->key = trace[i].key;
+        }
+        o->last = i;
+        o->size = trace[i].size;
+        fenwick_add(i, trace[i].size);
+    }
+
+    /* Sort the distances (with their sizes, for the byte hit ratio) so each size is a prefix. */
+    {
+        long long (*pairs)[2] = malloc((n_dist + 1) * sizeof(*pairs));
+        for (i = 0; i < n_dist; i++)
+        {
+            pairs[i][0] = distance[i];
+            pairs[i][1] = distance_size[i];
+        }
+        qsort(pairs, n_dist, sizeof(*pairs), compare_distance);
+        for (i = 0; i < n_dist; i++)
+        {
+            distance[i] = pairs[i][0];
+            distance_size[i] = pairs[i][1];
+        }
+        free(pairs);
+    }
+
+    printf("%ld requests, %lld bytes, %ld re-accesses of cacheable objects\n", n_trace, total_bytes, n_dist);
+    printf("%14s %10s %10s\n", "cache size", "hit ratio", "byte hits");
+
+    /* Walk the geometric sizes in increasing order, extending the prefix of hits. */
+    j = 0;
+    hits = 0;
+    hit_bytes = 0;
+    for (p = 0; p < points; p++)
+    {
+        capacity = points == 1 ? max_size
+                               : (long long)(min_size * pow((double)max_size / min_size, (double)p / (points - 1)));
+        for (; j < n_dist && distance[j] <= capacity; j++)
+        {
+            hits++;
+            hit_bytes += distance_size[j];
+        }
+        printf("%14lld %10.4f %10.4f%s\n", capacity,
+               n_trace ? (double)hits / n_trace : 0.0,
+               total_bytes ? (double)hit_bytes / total_bytes : 0.0,
+               capacity == MAX_CACHE_SIZE ? "  <- MAX_CACHE_SIZE" : "");
+    }
+
+    /* The analysis at the proxy's actual size, next to what cache.c really does. */
+    for (hits = 0, j = 0; j < n_dist && distance[j] <= MAX_CACHE_SIZE; j++)
+        hits++;
+    cache_c_ratio = replay_cache_c(&cache_c_hits, &hit_ns);
+    printf("at MAX_CACHE_SIZE (%d): stack distance %.4f, cache.c replay %.4f\n",
+           MAX_CACHE_SIZE, n_trace ? (double)hits / n_trace : 0.0, cache_c_ratio);
+    printf("cache.c hit latency: %.0f ns per hit\n", hit_ns);
+    cache_report(stdout);
+    return 0;
+}
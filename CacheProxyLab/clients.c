@@ -0,0 +1,344 @@
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "clients.h"
+
+#define NONE (-1)
+
+typedef struct client
+{
+    int family;               // AF_INET or AF_INET6 (0: slot unused)
+    unsigned char addr[16];   // (4 bytes of it for AF_INET)
+    double tokens;            // connections it may open now (at most burst)
+    long long refilled_us;    // when tokens was last brought up to date
+    unsigned long accepted;   // connections so far (including those turned away)
+    unsigned long limited;    // ... turned away for being over its rate
+    unsigned long reported;   // accepted at the previous report
+    int active;               // connections being handled
+    int pending;              // connections waiting for a worker: a queue, oldest first
+    int first, last;          // (indexes into waiting)
+    int next_turn;            // next client in turns (when it has connections waiting)
+} client;
+
+// A connection waiting for a worker.
+typedef struct waiter
+{
+    int fd;
+    int next; // next one of the same client (or on the free list)
+} waiter;
+
+static client clients[CLIENT_SLOTS];
+static waiter waiting[MAX_PENDING];
+static int free_waiter;              // free list of waiting
+static int turn_first = NONE;        // clients with connections waiting, in the order they get a worker
+static int turn_last = NONE;
+static int workers = 0;              // connections being handled (one worker each)
+static int pending = 0;
+static unsigned long limited = 0, turned_away = 0;
+static double rate, burst;           // per client: connections per second (0: no limit), and at once
+static int max_workers;
+static int max_per_client;           // workers one client may have (if max_workers > 0)
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Each client may open rate connections per second, burst of them at once (if rate > 0).
+// At most max_workers connections are handled at once (see CLIENT_SHARE).
+void clients_init(double client_rate, double client_burst, int workers_max)
+{
+    int i;
+
+    rate = client_rate;
+    burst = client_burst >= 1 ? client_burst : 1;
+    max_workers = workers_max;
+    max_per_client = workers_max / CLIENT_SHARE > 0 ? workers_max / CLIENT_SHARE : 1;
+    for (i = 0; i < MAX_PENDING; i++)
+        waiting[i].next = i + 1 < MAX_PENDING ? i + 1 : NONE;
+    free_waiter = 0;
+}
+
+// Bring client c's tokens up to date (they come back at rate per second, up to burst).
+static void refill(client *c)
+{
+    long long now = now_us();
+
+    c->tokens += rate * (now - c->refilled_us) / 1e6;
+    if (c->tokens > burst)
+        c->tokens = burst;
+    c->refilled_us = now;
+}
+
+// Whether the client in slot can give it up: it has no connection being handled or waiting,
+// and (with a rate) a full bucket, so that it would get no more from a new slot than it has.
+static int idle(int slot)
+{
+    client *c = &clients[slot];
+
+    if (c->family == 0)
+        return 1;
+    if (c->active > 0 || c->pending > 0)
+        return 0;
+    if (rate <= 0)
+        return 1;
+    refill(c);
+    return c->tokens >= burst;
+}
+
+// The slot of the client at peer (a new one, if it has none). Caller holds clients_lock.
+static int slot_of(struct sockaddr *peer)
+{
+    unsigned char *addr;
+    size_t len;
+    uint32_t h = 2166136261u;
+    int i, slot, free_slot = NONE, home;
+
+    if (peer->sa_family == AF_INET6)
+    {
+        addr = ((struct sockaddr_in6 *)peer)->sin6_addr.s6_addr;
+        len = 16;
+    }
+    else
+    {
+        addr = (unsigned char *)&((struct sockaddr_in *)peer)->sin_addr.s_addr;
+        len = 4;
+    }
+    for (i = 0; i < (int)len; i++)
+        h = (h ^ addr[i]) * 16777619u; // (FNV-1a)
+
+    home = h % CLIENT_SLOTS;
+    for (i = 0; i < CLIENT_PROBES; i++)
+    {
+        slot = (home + i) % CLIENT_SLOTS;
+        if (clients[slot].family == peer->sa_family && !memcmp(clients[slot].addr, addr, len))
+            return slot;
+        if (free_slot == NONE && idle(slot))
+            free_slot = slot;
+    }
+    if (free_slot == NONE)
+        return home;
+    memset(&clients[free_slot], 0, sizeof(client));
+    clients[free_slot].family = peer->sa_family;
+    memcpy(clients[free_slot].addr, addr, len);
+    clients[free_slot].tokens = burst;
+    clients[free_slot].refilled_us = now_us();
+    clients[free_slot].first = clients[free_slot].last = clients[free_slot].next_turn = NONE;
+    return free_slot;
+}
+
+// Whether client c may open another connection now (taking a token for it if so).
+static int take_token(client *c)
+{
+    if (rate <= 0)
+        return 1;
+    refill(c);
+    if (c->tokens < 1)
+        return 0;
+    c->tokens -= 1;
+    return 1;
+}
+
+// A connection (fd) was just accepted from peer: returns CLIENT_RUN (the caller starts a
+// worker for it, and passes it *slot), CLIENT_QUEUED (it waits for a worker), or
+// CLIENT_LIMITED or CLIENT_FULL (the caller turns it away).
+int clients_admit(struct sockaddr *peer, int fd, int *slot)
+{
+    client *c;
+    int w, status;
+
+    pthread_mutex_lock(&clients_lock);
+    *slot = slot_of(peer);
+    c = &clients[*slot];
+    c->accepted++;
+    if (!take_token(c))
+    {
+        c->limited++;
+        limited++;
+        status = CLIENT_LIMITED;
+    }
+    else if (max_workers <= 0 || (workers < max_workers && c->active < max_per_client))
+    {
+        workers++;
+        c->active++;
+        status = CLIENT_RUN;
+    }
+    else if (free_waiter == NONE)
+    {
+        turned_away++;
+        status = CLIENT_FULL;
+    }
+    else
+    {
+        w = free_waiter;
+        free_waiter = waiting[w].next;
+        waiting[w].fd = fd;
+        waiting[w].next = NONE;
+        if (c->pending++ == 0)
+        {
+            // (its turn comes after the clients that are waiting already)
+            c->first = w;
+            c->next_turn = NONE;
+            if (turn_last != NONE)
+                clients[turn_last].next_turn = *slot;
+            else
+                turn_first = *slot;
+            turn_last = *slot;
+        }
+        else
+        {
+            waiting[c->last].next = w;
+        }
+        c->last = w;
+        pending++;
+        status = CLIENT_QUEUED;
+    }
+    pthread_mutex_unlock(&clients_lock);
+    return status;
+}
+
+// The oldest connection of the first client in turn that is below its share of the workers
+// (the client goes to the back of the line, if it has more waiting), counted as being handled;
+// in *slot, its client. Or -1 if there is none. Caller holds clients_lock.
+static int take_waiting(int *slot)
+{
+    client *c;
+    int w, fd, prev = NONE;
+
+    for (*slot = turn_first; *slot != NONE; prev = *slot, *slot = clients[*slot].next_turn)
+        if (clients[*slot].active < max_per_client)
+            break;
+    if (*slot == NONE)
+        return -1;
+    c = &clients[*slot];
+    w = c->first;
+    fd = waiting[w].fd;
+    c->first = waiting[w].next;
+    waiting[w].next = free_waiter;
+    free_waiter = w;
+    pending--;
+    c->active++;
+
+    // (out of the line...)
+    if (prev != NONE)
+        clients[prev].next_turn = c->next_turn;
+    else
+        turn_first = c->next_turn;
+    if (turn_last == *slot)
+        turn_last = prev;
+    // (... and to the back of it, if it has more waiting)
+    if (--c->pending > 0)
+    {
+        c->next_turn = NONE;
+        if (turn_last != NONE)
+            clients[turn_last].next_turn = *slot;
+        else
+            turn_first = *slot;
+        turn_last = *slot;
+    }
+    return fd;
+}
+
+// A worker is done with a connection of the client in *slot. Returns the next connection it is
+// to handle (and its client, in *slot; see take_waiting); or -1 if none can be (the worker ends).
+int clients_next(int *slot)
+{
+    int fd;
+
+    pthread_mutex_lock(&clients_lock);
+    clients[*slot].active--;
+    if ((fd = take_waiting(slot)) < 0)
+        workers--;
+    pthread_mutex_unlock(&clients_lock);
+    return fd;
+}
+
+// A connection that can be handled now by a new worker, as there is one to spare (and its
+// client, in *slot; see take_waiting); or -1. It comes to be when a client below its share
+// has connections waiting, but no worker was done to take them (see clients_next, clients_leave).
+int clients_spare(int *slot)
+{
+    int fd = -1;
+
+    pthread_mutex_lock(&clients_lock);
+    if (workers < max_workers && (fd = take_waiting(slot)) >= 0)
+        workers++;
+    pthread_mutex_unlock(&clients_lock);
+    return fd;
+}
+
+// The worker for a connection of the client in slot goes on with it outside the workers (it
+// is a tunnel, which lasts as long as the client likes), and ends once done with it.
+void clients_leave(int slot)
+{
+    pthread_mutex_lock(&clients_lock);
+    clients[slot].active--;
+    workers--;
+    pthread_mutex_unlock(&clients_lock);
+}
+
+// The worker for a connection of the client in slot (just admitted as CLIENT_RUN) couldn't be started.
+void clients_abandon(int slot)
+{
+    pthread_mutex_lock(&clients_lock);
+    clients[slot].active--;
+    workers--;
+    pthread_mutex_unlock(&clients_lock);
+}
+
+// Print the totals, and the counters of the CLIENTS_REPORTED clients that connected most since
+// the previous report (interval seconds ago; 0: just the counts).
+void clients_report(FILE *out, int interval)
+{
+    int top[CLIENTS_REPORTED];
+    int n = 0, i, j, tracked = 0;
+    unsigned long recent;
+    char name[INET6_ADDRSTRLEN];
+    client *c;
+
+    pthread_mutex_lock(&clients_lock);
+    fprintf(out, "workers %d busy (at most %d, %d per client), %d connections waiting; %lu turned away over their rate, %lu with the queue full\n",
+            workers, max_workers, max_per_client, pending, limited, turned_away);
+    for (i = 0; i < CLIENT_SLOTS; i++)
+    {
+        if (clients[i].family == 0)
+            continue;
+        tracked++;
+        recent = clients[i].accepted - clients[i].reported;
+        if (recent == 0)
+            continue;
+        // (insertion into top, most first)
+        for (j = n < CLIENTS_REPORTED ? n++ : CLIENTS_REPORTED; j > 0; j--)
+        {
+            c = &clients[top[j - 1]];
+            if (c->accepted - c->reported >= recent)
+                break;
+            if (j < CLIENTS_REPORTED)
+                top[j] = top[j - 1];
+        }
+        if (j < CLIENTS_REPORTED)
+            top[j] = i;
+    }
+    fprintf(out, "clients %d tracked\n", tracked);
+    for (i = 0; i < n; i++)
+    {
+        c = &clients[top[i]];
+        inet_ntop(c->family, c->addr, name, sizeof(name));
+        if (interval > 0)
+            fprintf(out, "client %s: %lu connections (%.1f/s), %lu turned away in all; %d being handled, %d waiting\n",
+                    name, c->accepted - c->reported, (double)(c->accepted - c->reported) / interval, c->limited,
+                    c->active, c->pending);
+        else
+            fprintf(out, "client %s: %lu connections, %lu turned away in all; %d being handled, %d waiting\n",
+                    name, c->accepted - c->reported, c->limited, c->active, c->pending);
+    }
+    for (i = 0; i < CLIENT_SLOTS; i++)
+        clients[i].reported = clients[i].accepted;
+    pthread_mutex_unlock(&clients_lock);
+}
@@ -0,0 +1,41 @@
+/*
+The clients (by IP address) the proxy is serving, so that none of them can have it to itself:
+- each has a token bucket (-r): a connection takes a token, and one over the limit is turned
+  away with a 429 as soon as it is accepted;
+- at most max_workers connections are handled at once (-w), and at most 1/CLIENT_SHARE of them
+  for one client; the rest wait, in a queue per client, and a worker that is done takes the next
+  one from the clients in turn (round robin), so a client with a thousand connections waiting
+  gets no more turns than one with a single one, and one that holds its share (even with idle
+  connections) keeps no one else waiting.
+Clients are kept in a table of CLIENT_SLOTS, by a hash of their address; an idle client (no
+connection being handled or waiting, and a full bucket) gives way to a new one that needs its
+slot. If all the slots a client could have are busy, it shares the first with the client there.
+One mutex guards it all; it is taken once per connection accepted, and once per one finished.
+ */
+#ifndef CLIENTS_H
+#define CLIENTS_H
+
+#include <stdio.h>
+#include <sys/socket.h>
+
+#define CLIENT_SLOTS 4096   // clients tracked at once
+#define CLIENT_PROBES 8     // slots a client may have (from its hash on)
+#define MAX_PENDING 4096    // connections waiting for a worker (over all clients)
+#define CLIENTS_REPORTED 10 // clients in a report (the ones that connected most since the last)
+#define CLIENT_SHARE 4      // one client has at most 1/CLIENT_SHARE of the workers (at least one)
+
+// What to do with a connection just accepted (see clients_admit).
+#define CLIENT_RUN 0        // hand it to a new worker
+#define CLIENT_QUEUED 1     // nothing: it waits for a worker
+#define CLIENT_LIMITED 2    // turn it away: its client is over its rate
+#define CLIENT_FULL 3       // turn it away: too many are waiting already
+
+void clients_init(double rate, double burst, int max_workers);
+int clients_admit(struct sockaddr *peer, int fd, int *slot);
+int clients_next(int *slot);
+int clients_spare(int *slot);
+void clients_leave(int slot);
+void clients_abandon(int slot);
+void clients_report(FILE *out, int interval);
+
+#endif/*CLIENTS_H*/
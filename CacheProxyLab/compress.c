@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "compress.h"
+#include "http.h"
+
+#define MAX_CONTENT_TYPE 128
+#define GZIP_WINDOW_BITS (15 + 16) // +16: gzip framing (rather than raw zlib), so clients can use it as-is
+
+// Text is what compresses well, and what most of the cache holds.
+static const char *COMPRESSIBLE_TYPES[] = {
+    "text/", "application/javascript", "application/json", "application/xml", "image/svg+xml", NULL,
+};
+
+// Is the response resp (a 200, with its header of length header_len) worth compressing?
+int is_compressible(char *resp, size_t header_len)
+{
+    char value[MAX_CONTENT_TYPE];
+    int i;
+
+    if (response_status(resp, header_len) != 200)
+        return 0;
+    // Already encoded (or in an encoding we'd have to undo first): leave it alone.
+    if (get_header_field(resp, header_len, "Content-Encoding", value, sizeof(value)))
+        return 0;
+    if (!get_header_field(resp, header_len, "Content-Type", value, sizeof(value)))
+        return 0;
+
+    for (i = 0; COMPRESSIBLE_TYPES[i] != NULL; i++)
+    {
+        if (strncasecmp(value, COMPRESSIBLE_TYPES[i], strlen(COMPRESSIBLE_TYPES[i])) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Compress the body of resp (size bytes, of which header_len are header) into a new buffer *out:
+// the header, unchanged, then the gzip'ed body. Returns the size of *out, or 0 (and no buffer)
+// if compression failed or didn't make the response smaller.
+size_t gzip_response(char *resp, size_t header_len, size_t size, char **out)
+{
+    z_stream zs;
+    size_t bound, stored;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, GZIP_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0;
+
+    bound = deflateBound(&zs, size - header_len);
+    if ((*out = malloc(header_len + bound)) == NULL)
+    {
+        deflateEnd(&zs);
+        return 0;
+    }
+    memcpy(*out, resp, header_len);
+
+    zs.next_in = (Bytef *)resp + header_len;
+    zs.avail_in = size - header_len;
+    zs.next_out = (Bytef *)*out + header_len;
+    zs.avail_out = bound;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END || header_len + zs.total_out >= size)
+    {
+        deflateEnd(&zs);
+        free(*out);
+        *out = NULL;
+        return 0;
+    }
+    stored = header_len + zs.total_out;
+    deflateEnd(&zs);
+    return stored;
+}
+
+// The inverse of gzip_response, for a response whose header (header_len bytes) and gzip'ed body
+// (body_len bytes) are apart: a new buffer holding the response as the origin sent it
+// (original_size bytes). NULL if the body doesn't inflate to exactly that size.
+char *gunzip_response(char *header, size_t header_len, char *body, size_t body_len, size_t original_size)
+{
+    z_stream zs;
+    char *resp;
+    int ret;
+
+    if ((resp = malloc(original_size)) == NULL)
+        return NULL;
+    memcpy(resp, header, header_len);
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, GZIP_WINDOW_BITS) != Z_OK)
+    {
+        free(resp);
+        return NULL;
+    }
+    zs.next_in = (Bytef *)body;
+    zs.avail_in = body_len;
+    zs.next_out = (Bytef *)resp + header_len;
+    zs.avail_out = original_size - header_len;
+    ret = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+
+    if (ret != Z_STREAM_END || header_len + zs.total_out != original_size)
+    {
+        free(resp);
+        return NULL;
+    }
+    return resp;
+}
@@ -0,0 +1,14 @@
+/*
+Transparent gzip compression of cached text responses (see -z).
+A compressed cache entry keeps the response header as the origin sent it, followed
+by the body in gzip format; clients that accept gzip get those bytes as they are,
+everyone else gets the body inflated back.
+ */
+#include <stddef.h>
+
+#define CACHE_IDENTITY 0 // cached body is exactly what the origin sent
+#define CACHE_GZIP 1     // cached body is gzip-compressed (the header is not)
+
+int is_compressible(char *resp, size_t header_len);
+size_t gzip_response(char *resp, size_t header_len, size_t size, char **out);
+char *gunzip_response(char *header, size_t header_len, char *body, size_t body_len, size_t original_size);
@@ -6,8 +6,9 @@
 
 int error_args_fatal ( int argc, char **argv )
 {
-    if ( argc != 2 ) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    /* options (if any) have already been consumed by getopt; optind points past them. */
+    if ( argc - optind != 1 ) {
+	fprintf(stderr, "usage: %s [-a acceptors] [-A admin_port] [-b relay_buffer] [-c max_per_origin] [-C connect_ports] [-d drain_timeout] [-e negative_ttl] [-i stats_interval] [-l access_log] [-m shared_cache] [-N numa_node] [-r client_rate[/burst]] [-s snapshot_file] [-S snapshot_interval] [-t connect_timeout_ms] [-U] [-w max_workers] [-z] <port>\n", argv[0]);
 	return 1;
     } // assumption: the argument provided, is a valid port number.
     return 0;
@@ -64,14 +65,13 @@ int error_listen_fatal( int returncode )
 }
 
 
+/* an accept failed (returncode < 0): is the listening socket itself unusable? then its accept
+   loop can only stop. anything else passes (the connection failed before it was accepted, or
+   the proxy ran out of file descriptors or memory for a moment; see accept_failed in proxy.c). */
 int error_accept_fatal ( int returncode ) {
     if ( returncode < 0 ) {
-	// error occurred. was it a bad one?
-	if ( ! ( errno == ENETDOWN   || errno == EPROTO || errno == ENOPROTOOPT  ||
-		 errno == EHOSTDOWN  || errno == ENONET || errno == EHOSTUNREACH ||
-		 errno == EOPNOTSUPP || errno == ENETUNREACH ) ) {
-	    // it's a bad one; terminate.
-	    fprintf(stderr, "\033[31mfailure\033[0m to accept connection. fatal.\n");
+	if ( errno == EBADF || errno == EINVAL || errno == ENOTSOCK || errno == EFAULT ) {
+	    fprintf(stderr, "\033[31mfailure\033[0m to accept connection (%s). this accept loop stops.\n", strerror(errno));
 	    return 1;
 	}
     }
@@ -158,9 +158,8 @@ int error_write_server ( int server_fd, int n ) {
 
 int error_write_client ( int client_fd, int n ) {
     if ( n < 0 ) {
+	/* (the fd is closed by handle_connection_request, like on success.) */
 	fprintf(stderr, "\033[31mfailure:\033[0m error writing to client fd. dropping request.\n");
-	n = close ( client_fd );
-	if ( error_close ( n ) ) { /* ignored */}
 	return 1;
     }
     printf("wrote %*d bytes to client.\n", 4, n );
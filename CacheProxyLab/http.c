@@ -1,19 +1,41 @@
-/* String constants */
-static const char *REQUEST_LINE_FMT =
-    "GET %s HTTP/1.0\r\n";
-static const char *USER_AGENT_FLD =
+/* String constants (arrays, so their lengths are known at compile time) */
+static const char REQUEST_LINE_FMT[] =
+    "GET %s HTTP/1.1\r\n";
+static const char USER_AGENT_FLD[] =
     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char *HOST_FLD_FMT =
-    "Host: %s：%s\r\n";
-static const char *CONNECTION_FLD =
+static const char HOST_FLD_FMT[] =
+    "Host: %s:%s\r\n";
+static const char CONNECTION_FLD[] =
     "Connection: close\r\n";
-static const char *PROXY_CONNECTION_FLD =
+static const char PROXY_CONNECTION_FLD[] =
     "Proxy-Connection: close\r\n";
-static const char *BLANK_LINE =
+static const char BLANK_LINE[] =
     "\r\n";
+#define MAX_FIELD_NAME 128
 
+static const char PARTIAL_STATUS_LINE[] =
+    "HTTP/1.0 206 Partial Content\r\n";
+static const char CONTENT_RANGE_FLD_FMT[] =
+    "Content-Range: bytes %zu-%zu/%zu\r\n";
+static const char CONTENT_LENGTH_FLD_FMT[] =
+    "Content-Length: %zu\r\n";
+static const char GZIP_ENCODING_FLD[] =
+    "Content-Encoding: gzip\r\n";
+static const char VARY_ENCODING_FLD[] =
+    "Vary: Accept-Encoding\r\n";
+static const char UNSATISFIABLE_RESPONSE_FMT[] =
+    "HTTP/1.0 416 Range Not Satisfiable\r\nContent-Range: bytes */%zu\r\nContent-Length: 0\r\n\r\n";
+static const char ORIGIN_ERROR_RESPONSE_FMT[] =
+    "HTTP/1.0 %d %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\nRetry-After: %d\r\n\r\n%s\n";
+static const char CLIENT_ERROR_RESPONSE_FMT[] =
+    "HTTP/1.0 %d %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n%s\n";
+static const char CONNECT_ESTABLISHED_RESPONSE[] =
+    "HTTP/1.0 200 Connection established\r\n\r\n";
+
+#define _GNU_SOURCE // strcasestr
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "http.h"  // http-related things for ^
 #include "io.h"
@@ -24,47 +46,55 @@ static const char *BLANK_LINE =
    expected to understand what is going on here.*/
 
 /* compile a request header from fields provided by the client, as well as 
- * hostname, path and port. write the resulting header to request_hdr. */
-int set_request_header ( char* request_hdr, char* hostname, char* path, char* port, int client_fd )
+ * hostname, path and port. append the resulting header to request_hdr.
+ * return 1, 0 on read errors, or -1 if the header doesn't fit (the client's
+ * header is still read to its end, so that it can be answered). */
+int set_request_header ( strbuf* request_hdr, char* hostname, char* path, char* port, line_reader *client )
 {
     /* an HTTP request header consists of a request line, followed by header fields.
        each header field is a key-value pair of the form `k: v\r\n`. */
-    char request_line[MAX_LINE];// request line (first line of a request header)
-    char host_fld[MAX_LINE];    // host field
-    char other_flds[MAX_LINE];  // other fields
-    
-    char line[MAX_LINE];        // a buffer for storing lines read from client_fd
-    int return_cd;              // return code for reads from client_fd
+    char host_storage[MAX_LINE];  // host field
+    char other_storage[MAX_LINE]; // other fields
+    strbuf host_fld;
+    strbuf other_flds;
     
-    /* Proxy sets request line (We only handle GET requests, in HTTP/1.0.) */
-    sprintf(request_line, REQUEST_LINE_FMT, path);
+    char line[MAX_LINE];        // a buffer for storing lines read from the client
+    int return_cd;              // return code for reads from the client
+    int too_big = 0;            // a field didn't fit; the rest are read, and dropped
+
+    /* the builders track their own length, so no field is ever rescanned
+       (unlike `strcat`, which walks the whole destination on every call). */
+    strbuf_init ( &host_fld, host_storage, sizeof(host_storage) );
+    strbuf_init ( &other_flds, other_storage, sizeof(other_storage) );
 
     /* Proxy sets `User-Agent`, `Connection`, and `Proxy-Connection` fields;
-       see proxy.h for their values. */
+       see http.h for their values. */
     
     /* Default host field, in case client request does not contain one. */
-    sprintf(host_fld, HOST_FLD_FMT, hostname, port);
+    if ( strbuf_appendf ( &host_fld, HOST_FLD_FMT, hostname, port ) < 0 ) { return 0; /*error*/ }
 
-    /* Get any other fields from client_fd */
+    /* Get any other fields from the client */
     return_cd = 1;
     while ( return_cd > 0 )
     {
 	/* read the next line. */
-	return_cd = read_line ( client_fd, line );
+	return_cd = read_line_buffered ( client, line );
 	if ( error_read ( return_cd ) ) { return 0; /*error*/ }
 
-	/* null-terminate the string read from client_fd.
+	/* null-terminate the string read from the client.
 	   NOTE: by doing this, we are ignoring an edge case where
 	   the line read has length MAX_LEN */
 	line[return_cd] = '\0';
 	
-	/* if we reached end-of-client-request, then stop reading from client_fd. */
+	/* if we reached end-of-client-request, then stop reading from the client. */
         if ( strncasecmp ( line, BLANK_LINE, strlen(BLANK_LINE) ) == 0  ) break;
+	if ( too_big ) continue;
 
 	/* if client provided a host field, then we use client's host field. */
         if ( strncasecmp ( line, "Host:", strlen("Host:") ) == 0 )
 	{
-            strcpy ( host_fld, line );
+            strbuf_init ( &host_fld, host_storage, sizeof(host_storage) );
+            if ( strbuf_append ( &host_fld, line, return_cd ) < 0 ) { too_big = 1; }
             continue;
         }
 
@@ -78,23 +108,87 @@ int set_request_header ( char* request_hdr, char* hostname, char* path, char* po
         }
 
 	/* otherwise, this field is a keeper. */
-	strcat( other_flds, line );
+	if ( strbuf_append ( &other_flds, line, return_cd ) < 0 ) { too_big = 1; }
+    }
+    if ( too_big ) { return -1; }
+
+
+    /* set the request header. (Proxy sets request line; we only handle GET requests, in HTTP/1.1,
+       which lets the origin send a body chunked; see chunk_decode.) */
+    if ( strbuf_appendf ( request_hdr, REQUEST_LINE_FMT, path ) < 0                      ||
+         strbuf_append ( request_hdr, host_fld.data, host_fld.len ) < 0                 ||
+         strbuf_append_lit ( request_hdr, USER_AGENT_FLD ) < 0                          ||
+         strbuf_append ( request_hdr, other_flds.data, other_flds.len ) < 0             ||
+         strbuf_append_lit ( request_hdr, CONNECTION_FLD ) < 0                          ||
+         strbuf_append_lit ( request_hdr, PROXY_CONNECTION_FLD ) < 0                    ||
+         strbuf_append_lit ( request_hdr, BLANK_LINE ) < 0 )
+    {
+        return -1; /* header does not fit */
     }
-    
-    /* set the request header. */
-    request_hdr[0] = '\0';
-    strcat ( request_hdr, request_line );
-    strcat ( request_hdr, host_fld );
-    strcat ( request_hdr, USER_AGENT_FLD );
-    strcat ( request_hdr, other_flds );
-    strcat ( request_hdr, CONNECTION_FLD );
-    strcat ( request_hdr, PROXY_CONNECTION_FLD );
-    strcat ( request_hdr, BLANK_LINE );
 
     /* success. */
     return 1;
 }
 
+/* read the rest of a CONNECT request's header from the client (its fields are for the
+   proxy, and we have no use for them), up to and including the blank line that ends it.
+   anything the client sent after that stays in the reader. return 1, or 0 on errors. */
+int skip_request_header ( line_reader *client )
+{
+    char line[MAX_LINE];
+    int return_cd;
+
+    while ( 1 )
+    {
+	return_cd = read_line_buffered ( client, line );
+	if ( error_read ( return_cd ) ) { return 0; /*error*/ }
+	if ( return_cd == 0 ) { return 0; /*EOF, or a line too long*/ }
+	line[return_cd] = '\0';
+	if ( strncmp ( line, BLANK_LINE, strlen(BLANK_LINE) ) == 0 ) { return 1; }
+    }
+}
+
+/* parse the target of a CONNECT request, `host:port` (RFC 9110 9.3.6; an IPv6 host is in
+   brackets, e.g. `[::1]:443`), into hostname and port (each of size bytes). the port must
+   be there. return 1, or 0 if the target is malformed or doesn't fit. */
+int parse_connect_target ( char* target, char* hostname, char* port, size_t size )
+{
+    char* colon = strrchr ( target, ':' );
+    size_t host_len;
+
+    if ( colon == NULL || colon == target || colon[1] == '\0' ) return 0;
+    if ( strspn ( colon + 1, "0123456789" ) != strlen ( colon + 1 ) ) return 0;
+    if ( target[0] == '[' ) {
+	if ( colon[-1] != ']' ) return 0;
+	target++;           // the brackets aren't part of the address.
+	host_len = colon - 1 - target;
+    } else {
+	host_len = colon - target;
+    }
+    if ( host_len == 0 || host_len >= size || strlen ( colon + 1 ) >= size ) return 0;
+
+    memcpy ( hostname, target, host_len );
+    hostname[host_len] = '\0';
+    strcpy ( port, colon + 1 );
+    return 1;
+}
+
+/* is port one of ports (comma-separated, e.g. "443,8443")? */
+int port_listed ( char* port, char* ports )
+{
+    size_t len = strlen ( port );
+    size_t n;
+
+    while ( *ports != '\0' )
+    {
+	n = strcspn ( ports, "," );
+	if ( n == len && strncmp ( ports, port, len ) == 0 ) return 1;
+	ports += n;
+	if ( *ports == ',' ) ports++;
+    }
+    return 0;
+}
+
 /* parse the uri into hostname, path, and port. */
 void parse_uri(char* uri, char* hostname, char* path, char* port)
 {
@@ -123,3 +217,376 @@ void parse_uri(char* uri, char* hostname, char* path, char* port)
         strcpy(hostname, pstart);
     }
 }
+
+/* find header field `name` (e.g. "Range") in the header hdr (of length len; the first
+   line, i.e. the request/status line, is skipped). copy its value, without surrounding
+   whitespace, to value. return 1 if found, 0 otherwise, or -1 if found but its value is longer
+   than value_size - 1 bytes (value then has only that much of it). */
+int get_header_field ( char* hdr, size_t len, char* name, char* value, size_t value_size )
+{
+    size_t name_len = strlen ( name );
+    char* end = hdr + len;
+    char* line = memchr ( hdr, '\n', len );  // end of the first line
+    char* eol;
+    size_t n;
+
+    while ( line != NULL && ++line < end )
+    {
+	eol = memchr ( line, '\n', end - line );
+	if ( eol == NULL ) eol = end;
+	/* a blank line ends the header. */
+	if ( *line == '\r' || *line == '\n' ) return 0;
+
+	if ( eol - line > name_len && line[name_len] == ':' && strncasecmp ( line, name, name_len ) == 0 )
+	{
+	    char* v = line + name_len + 1;
+	    while ( v < eol && ( *v == ' ' || *v == '\t' ) ) v++;
+	    n = eol - v;
+	    while ( n > 0 && ( v[n-1] == '\r' || v[n-1] == ' ' || v[n-1] == '\t' ) ) n--;
+	    if ( n >= value_size ) {
+		memcpy ( value, v, value_size - 1 );
+		value[value_size - 1] = '\0';
+		return -1;
+	    }
+	    memcpy ( value, v, n );
+	    value[n] = '\0';
+	    return 1;
+	}
+	line = eol < end ? eol : NULL;
+    }
+    return 0;
+}
+
+/* length of the header of the response resp (up to and including the blank line),
+   or 0 if resp (of length len) doesn't contain a complete header. */
+size_t response_header_length ( char* resp, size_t len )
+{
+    size_t i;
+    for ( i = 3; i < len; i++ )
+	if ( resp[i] == '\n' && resp[i-1] == '\r' && resp[i-2] == '\n' && resp[i-3] == '\r' )
+	    return i + 1;
+    return 0;
+}
+
+/* the status code in the status line of response resp (e.g. 200), or 0 if there is none. */
+int response_status ( char* resp, size_t len )
+{
+    char line[32];
+    int status = 0;
+    if ( len >= sizeof(line) ) len = sizeof(line) - 1;
+    memcpy ( line, resp, len );
+    line[len] = '\0';
+    if ( sscanf ( line, "HTTP/%*d.%*d %d", &status ) != 1 ) return 0;
+    return status;
+}
+
+/* parse the value of a Range field (e.g. "bytes=0-499", "bytes=500-", "bytes=-500") against
+   an object of `length` bytes, into the first and last byte position (inclusive).
+   return 1 if satisfiable, 0 if not (-> 416), and -1 if the range is not one we serve
+   (anything but a single byte range); the whole object is sent in that case. */
+int parse_range ( char* value, size_t length, size_t* first, size_t* last )
+{
+    char* p;
+    char* endp;
+    unsigned long long a, b;
+
+    if ( strncasecmp ( value, "bytes=", strlen("bytes=") ) != 0 ) return -1;
+    p = value + strlen("bytes=");
+    if ( strchr ( p, ',' ) != NULL ) return -1; // multiple ranges; not supported.
+
+    if ( *p == '-' ) {
+	/* suffix range: the last b bytes. */
+	b = strtoull ( p + 1, &endp, 10 );
+	if ( endp == p + 1 || *endp != '\0' ) return -1;
+	if ( b == 0 || length == 0 ) return 0;
+	*first = b >= length ? 0 : length - b;
+	*last  = length - 1;
+	return 1;
+    }
+
+    a = strtoull ( p, &endp, 10 );
+    if ( endp == p || *endp != '-' ) return -1;
+    p = endp + 1;
+    if ( *p == '\0' ) {
+	b = length - 1; // open-ended: to the end.
+    } else {
+	b = strtoull ( p, &endp, 10 );
+	if ( *endp != '\0' || b < a ) return -1;
+    }
+    if ( a >= length ) return 0;
+    *first = a;
+    *last  = b >= length ? length - 1 : b;
+    return 1;
+}
+
+/* append the header fields of the response header resp (of length header_len) to hdr,
+   except the status line, the blank line, and the fields named in skip (NULL-terminated). */
+static int append_fields_except ( strbuf* hdr, char* resp, size_t header_len, const char** skip )
+{
+    char* end = resp + header_len;
+    char* line = memchr ( resp, '\n', header_len ); // skip the status line
+    char* eol;
+    int i;
+
+    if ( line == NULL ) return 0;
+    for ( line++; line < end; line = eol + 1 )
+    {
+	eol = memchr ( line, '\n', end - line );
+	if ( eol == NULL || *line == '\r' || *line == '\n' ) break; // blank line: end of header.
+	for ( i = 0; skip[i] != NULL; i++ )
+	    if ( strncasecmp ( line, skip[i], strlen(skip[i]) ) == 0 ) break;
+	if ( skip[i] != NULL ) continue;
+	if ( strbuf_append ( hdr, line, eol + 1 - line ) < 0 ) return 0;
+    }
+    return 1;
+}
+
+/* compile the header of a 206 (Partial Content) response for bytes first..last of a cached
+   200 response, whose header (of length header_len) is resp. the original fields are kept,
+   except the ones describing the length. */
+int set_partial_response_header ( strbuf* hdr, char* resp, size_t header_len, size_t first, size_t last, size_t total )
+{
+    static const char* skip[] = { "Content-Length:", "Content-Range:", NULL };
+
+    if ( strbuf_append_lit ( hdr, PARTIAL_STATUS_LINE ) < 0 ||
+	 ! append_fields_except ( hdr, resp, header_len, skip ) ) return 0;
+
+    if ( strbuf_appendf ( hdr, CONTENT_RANGE_FLD_FMT, first, last, total ) < 0 ||
+	 strbuf_appendf ( hdr, CONTENT_LENGTH_FLD_FMT, last - first + 1 ) < 0  ||
+	 strbuf_append_lit ( hdr, BLANK_LINE ) < 0 ) return 0;
+    return 1;
+}
+
+/* compile the header for sending the cached response resp (header of length header_len)
+   with its body gzip-encoded (length bytes of it). the ETag goes, since it names the
+   unencoded representation, and caches downstream are told the body depends on Accept-Encoding. */
+int set_gzip_response_header ( strbuf* hdr, char* resp, size_t header_len, size_t length )
+{
+    static const char* skip[] = { "Content-Length:", "ETag:", "Vary:", NULL };
+    char* eol = memchr ( resp, '\n', header_len );
+    char vary[MAX_LINE];
+
+    if ( eol == NULL || strbuf_append ( hdr, resp, eol + 1 - resp ) < 0 ||   // the status line
+	 ! append_fields_except ( hdr, resp, header_len, skip ) ) return 0;
+
+    /* keep the origin's Vary, adding Accept-Encoding to it. */
+    if ( get_header_field ( resp, header_len, "Vary", vary, sizeof(vary) ) ) {
+	if ( strbuf_appendf ( hdr, "Vary: %s, Accept-Encoding\r\n", vary ) < 0 ) return 0;
+    } else if ( strbuf_append_lit ( hdr, VARY_ENCODING_FLD ) < 0 ) return 0;
+
+    if ( strbuf_append_lit ( hdr, GZIP_ENCODING_FLD ) < 0               ||
+	 strbuf_appendf ( hdr, CONTENT_LENGTH_FLD_FMT, length ) < 0     ||
+	 strbuf_append_lit ( hdr, BLANK_LINE ) < 0 ) return 0;
+    return 1;
+}
+
+/* compile the header of the response resp (header of length header_len) for its body as it is
+   without the origin's framing (e.g. once a chunked body is decoded): the fields about that
+   framing go, and a Content-Length of `length` is put in, if length >= 0 (otherwise the body
+   ends where the connection does). */
+int set_unframed_response_header ( strbuf* hdr, char* resp, size_t header_len, ssize_t length )
+{
+    static const char* skip[] = { "Transfer-Encoding:", "Content-Length:", "Trailer:", NULL };
+    char* eol = memchr ( resp, '\n', header_len );
+
+    if ( eol == NULL || strbuf_append ( hdr, resp, eol + 1 - resp ) < 0 ||   // the status line
+	 ! append_fields_except ( hdr, resp, header_len, skip ) ) return 0;
+    if ( length >= 0 && strbuf_appendf ( hdr, CONTENT_LENGTH_FLD_FMT, (size_t)length ) < 0 ) return 0;
+    if ( strbuf_append_lit ( hdr, BLANK_LINE ) < 0 ) return 0;
+    return 1;
+}
+
+/* is the body of the response resp (header of length header_len) chunked, and only that?
+   (a body with other transfer codings too is relayed as it is.) */
+int is_chunked ( char* resp, size_t header_len )
+{
+    char value[64];
+
+    if ( ! get_header_field ( resp, header_len, "Transfer-Encoding", value, sizeof(value) ) ) return 0;
+    return strcasecmp ( value, "chunked" ) == 0;
+}
+
+/* where a chunk_decoder is in the framing: a chunk is `size[;ext]\r\n data \r\n`,
+   and a chunk of size 0 ends the body, followed by trailer fields and a blank line. */
+enum { CHUNK_SIZE, CHUNK_EXT, CHUNK_SIZE_LF, CHUNK_DATA, CHUNK_DATA_CR, CHUNK_DATA_LF, CHUNK_TRAILER, CHUNK_DONE };
+
+void chunk_decoder_init ( chunk_decoder* d )
+{
+    d->state = CHUNK_SIZE;
+    d->digits = 0;
+    d->remaining = 0;
+    d->line_len = 0;
+}
+
+/* decode the next len bytes of a chunked body, at data, in place: the body's bytes are moved
+   to the start of data (the framing around them is dropped), and anything after the end of
+   the body is ignored. return the number of body bytes now at data, or -1 if the framing is
+   broken (RFC 9112 7.1; a bare \n is taken for \r\n). */
+ssize_t chunk_decode ( chunk_decoder* d, char* data, size_t len )
+{
+    size_t in = 0, out = 0, n;
+    char c;
+    int digit;
+
+    while ( in < len && d->state != CHUNK_DONE )
+    {
+	if ( d->state == CHUNK_DATA ) {
+	    n = len - in < d->remaining ? len - in : d->remaining;
+	    memmove ( data + out, data + in, n );
+	    in += n;
+	    out += n;
+	    if ( ( d->remaining -= n ) == 0 ) d->state = CHUNK_DATA_CR;
+	    continue;
+	}
+
+	c = data[in++];
+	switch ( d->state )
+	{
+	case CHUNK_SIZE:
+	    digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+		    c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+	    if ( digit >= 0 ) {
+		if ( ++d->digits > 15 ) return -1; // (no chunk is that big)
+		d->remaining = d->remaining * 16 + digit;
+		break;
+	    }
+	    if ( d->digits == 0 ) return -1;
+	    if ( c == ';' || c == ' ' || c == '\t' ) d->state = CHUNK_EXT;
+	    else if ( c == '\r' ) d->state = CHUNK_SIZE_LF;
+	    else if ( c == '\n' ) goto size_line_done;
+	    else return -1;
+	    break;
+	case CHUNK_EXT:
+	    /* chunk extensions: we have no use for them. */
+	    if ( c == '\r' ) d->state = CHUNK_SIZE_LF;
+	    else if ( c == '\n' ) goto size_line_done;
+	    break;
+	case CHUNK_SIZE_LF:
+	    if ( c != '\n' ) return -1;
+	size_line_done:
+	    d->state = d->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+	    d->line_len = 0;
+	    break;
+	case CHUNK_DATA_CR:
+	    if ( c == '\r' ) d->state = CHUNK_DATA_LF;
+	    else if ( c == '\n' ) { d->state = CHUNK_SIZE; d->digits = 0; }
+	    else return -1;
+	    break;
+	case CHUNK_DATA_LF:
+	    if ( c != '\n' ) return -1;
+	    d->state = CHUNK_SIZE;
+	    d->digits = 0;
+	    break;
+	case CHUNK_TRAILER:
+	    /* trailer fields (dropped), up to a blank line. */
+	    if ( c == '\n' ) {
+		if ( d->line_len == 0 ) d->state = CHUNK_DONE;
+		d->line_len = 0;
+	    }
+	    else if ( c != '\r' ) d->line_len++;
+	    break;
+	}
+    }
+    return out;
+}
+
+/* has the decoder seen the end of the body? */
+int chunk_done ( chunk_decoder* d )
+{
+    return d->state == CHUNK_DONE;
+}
+
+/* does the request (header fields req, of length len) accept a gzip-encoded body? */
+int accepts_gzip ( char* req, size_t len )
+{
+    char value[MAX_LINE];
+    char* gzip;
+
+    if ( ! get_header_field ( req, len, "Accept-Encoding", value, sizeof(value) ) ) return 0;
+    if ( ( gzip = strcasestr ( value, "gzip" ) ) == NULL ) return 0;
+    /* "gzip;q=0" means: anything but gzip. */
+    gzip += strlen("gzip");
+    while ( *gzip == ' ' ) gzip++;
+    if ( strncmp ( gzip, ";q=0", 4 ) == 0 && strspn ( gzip + 4, "0." ) == strcspn ( gzip + 4, "," ) ) return 0;
+    return 1;
+}
+
+/* compile a 416 (Range Not Satisfiable) response, for an object of `total` bytes. */
+int set_unsatisfiable_response ( strbuf* hdr, size_t total )
+{
+    if ( strbuf_appendf ( hdr, UNSATISFIABLE_RESPONSE_FMT, total ) < 0 ) return 0;
+    return 1;
+}
+
+/* compile the response sent in place of an origin's, when the origin is failing
+   (status: 502 if it could not be reached, 504 if it timed out, or the 5xx it sent),
+   or when the proxy won't handle a client's connection (429, or 503; see clients.h). */
+int set_origin_error_response ( strbuf* resp, int status, int retry_after )
+{
+    const char* reason;
+    switch ( status )
+    {
+    case 429: reason = "Too Many Requests"; break;
+    case 502: reason = "Bad Gateway"; break;
+    case 503: reason = "Service Unavailable"; break;
+    case 504: reason = "Gateway Timeout"; break;
+    default:  reason = "Origin Error"; break;
+    }
+    if ( strbuf_appendf ( resp, ORIGIN_ERROR_RESPONSE_FMT, status, reason, strlen(reason) + 1,
+			  retry_after, reason ) < 0 ) return 0;
+    return 1;
+}
+
+/* compile the response to a request the proxy won't forward (status: 400 if it is malformed,
+   or its header doesn't fit; 403 if it is for a place the proxy doesn't go). */
+int set_client_error_response ( strbuf* resp, int status )
+{
+    const char* reason;
+    switch ( status )
+    {
+    case 400: reason = "Bad Request"; break;
+    case 403: reason = "Forbidden"; break;
+    default:  reason = "Client Error"; break;
+    }
+    if ( strbuf_appendf ( resp, CLIENT_ERROR_RESPONSE_FMT, status, reason, strlen(reason) + 1, reason ) < 0 ) return 0;
+    return 1;
+}
+
+/* compile the response that tells a client its CONNECT tunnel is open (after it, the
+   connection carries whatever the client and the origin send each other). */
+int set_connect_response ( strbuf* resp )
+{
+    if ( strbuf_append_lit ( resp, CONNECT_ESTABLISHED_RESPONSE ) < 0 ) return 0;
+    return 1;
+}
+
+/* compile the secondary cache key of a response whose Vary field was `vary` (e.g.
+   "Accept-Encoding, Accept-Language"), for a request with header fields req (of length len):
+   one `name: value` line per field name, in the order Vary lists them (an absent field
+   has an empty value). two requests may share the response iff their keys are equal. */
+int set_variant_key ( strbuf* key, char* vary, char* req, size_t len )
+{
+    char name[MAX_FIELD_NAME];
+    char value[MAX_LINE];
+    char* p = vary;
+    size_t n;
+
+    while ( *p != '\0' )
+    {
+	/* next comma-separated field name. */
+	while ( *p == ' ' || *p == '\t' || *p == ',' ) p++;
+	n = strcspn ( p, ", \t" );
+	if ( n == 0 ) break;
+	if ( n >= sizeof(name) ) return 0;
+	memcpy ( name, p, n );
+	name[n] = '\0';
+	p += n;
+
+	switch ( get_header_field ( req, len, name, value, sizeof(value) ) ) {
+	case 0:  value[0] = '\0'; break;
+	case -1: return 0; // (a key from part of the value would be shared with other values)
+	}
+	if ( strbuf_appendf ( key, "%s: %s\n", name, value ) < 0 ) return 0;
+    }
+    return 1;
+}
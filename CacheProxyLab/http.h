@@ -1,3 +1,41 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <sys/types.h>
+#include "strbuf.h"
+
+struct line_reader; // io.h
+
+/* decodes a chunked body (Transfer-Encoding: chunked) as it arrives, in whatever pieces. */
+typedef struct chunk_decoder
+{
+    int state;        // where in the framing the next byte is (see http.c)
+    int digits;       // hex digits of the chunk size read so far
+    size_t remaining; // of the current chunk's size: bytes not yet decoded (or the size, while reading it)
+    size_t line_len;  // in the trailer: bytes in the current line
+} chunk_decoder;
+
 void parse_uri ( char* uri, char* hostname, char* path, char* port );
-int  set_request_header ( char* request_hdr, char* hostname, char* path, char* port, int fd );
+int  set_request_header ( strbuf* request_hdr, char* hostname, char* path, char* port, struct line_reader *client );
+int  skip_request_header ( struct line_reader *client );
+int  parse_connect_target ( char* target, char* hostname, char* port, size_t size );
+int  port_listed ( char* port, char* ports );
+int  get_header_field ( char* hdr, size_t len, char* name, char* value, size_t value_size );
+size_t response_header_length ( char* resp, size_t len );
+int  response_status ( char* resp, size_t len );
+int  parse_range ( char* value, size_t length, size_t* first, size_t* last );
+int  set_partial_response_header ( strbuf* hdr, char* resp, size_t header_len, size_t first, size_t last, size_t total );
+int  set_unsatisfiable_response ( strbuf* hdr, size_t total );
+int  set_origin_error_response ( strbuf* resp, int status, int retry_after );
+int  set_client_error_response ( strbuf* resp, int status );
+int  set_connect_response ( strbuf* resp );
+int  set_variant_key ( strbuf* key, char* vary, char* req, size_t len );
+int  set_gzip_response_header ( strbuf* hdr, char* resp, size_t header_len, size_t length );
+int  set_unframed_response_header ( strbuf* hdr, char* resp, size_t header_len, ssize_t length );
+int  is_chunked ( char* resp, size_t header_len );
+void chunk_decoder_init ( chunk_decoder* d );
+ssize_t chunk_decode ( chunk_decoder* d, char* data, size_t len );
+int  chunk_done ( chunk_decoder* d );
+int  accepts_gzip ( char* req, size_t len );
 
+#endif/*HTTP_H*/
@@ -1,5 +1,7 @@
 #include <unistd.h>
+#include <string.h>
 #include <errno.h>
+#include <sys/uio.h>
 #include "io.h"
 
 /* keeps calling `write` while there are bytes remaining to be written, until
@@ -33,6 +35,56 @@ ssize_t write_all ( int fd, void *bf, size_t n)
     return w_tot; // success (w_tot = n)
 }
 
+/* like write_all, but gathers the bytes from several buffers, so that e.g. a header
+   and a body leave in one system call (and hence, typically, in one packet). */
+ssize_t writev_all ( int fd, struct iovec *iov, int iovcnt )
+{
+    ssize_t w_tot = 0; // bytes written in total
+    ssize_t w_cur = 0; // bytes written in current iteration
+
+    while ( iovcnt > 0 ) {
+	/* "Kernel, please (attempt to) write these buffers, in order, to `fd`."
+	   https://man7.org/linux/man-pages/man2/writev.2.html (a system call) */
+	w_cur = writev ( fd, iov, iovcnt );
+	if ( w_cur < 0 ) {
+	    if ( errno == EINTR ) continue; // interrupted before anything was written. try again.
+	    return -1;
+	}
+	w_tot += w_cur;
+	/* skip the buffers that were written entirely, and the written part of the next one. */
+	while ( iovcnt > 0 && w_cur >= iov->iov_len ) {
+	    w_cur -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if ( iovcnt > 0 ) {
+	    iov->iov_base = (char *)iov->iov_base + w_cur;
+	    iov->iov_len -= w_cur;
+	}
+    }
+    return w_tot; // success
+}
+
+/* keeps calling `read` until `n` bytes are read. returns n, 0 if fd was at EOF
+   (before anything was read), or -1 on errors and on EOF part way. */
+ssize_t read_all ( int fd, void *bf, size_t n )
+{
+    ssize_t r_tot = 0; // bytes read in total
+    ssize_t r_cur = 0; // bytes read in current iteration
+
+    while ( r_tot < n ) {
+	r_cur = read ( fd, bf, n - r_tot );
+	if ( r_cur < 0 ) {
+	    if ( errno == EINTR ) continue; // interrupted before anything was read. try again.
+	    return -1;
+	}
+	if ( r_cur == 0 ) return r_tot == 0 ? 0 : -1; // EOF
+	r_tot += r_cur;
+	bf    += r_cur;
+    }
+    return r_tot; // success (r_tot = n)
+}
+
 int read_line ( int fd, char* bf )
 {
     int n = 0;     // number of characters read, in total
@@ -57,3 +109,40 @@ int read_line ( int fd, char* bf )
     } while ( n < MAX_LINE );
     return 0; // no newline found.
 }
+
+void line_reader_init ( line_reader *r, int fd )
+{
+    r->fd = fd;
+    r->start = r->end = 0;
+}
+
+/* like read_line (returns the number of bytes in the line, \n included; 0 on EOF or when
+   no newline is found within MAX_LINE bytes; < 0 on errors), but refills the reader's
+   buffer with everything the fd has ready, and copies lines out of that. */
+int read_line_buffered ( line_reader *r, char* bf )
+{
+    int n = 0; // number of characters copied to bf, in total
+    ssize_t returnval;
+    char *nl;
+    size_t take;
+
+    while ( n < MAX_LINE ) {
+	if ( r->start == r->end ) {
+	    /* buffer used up: one `read`, for as many bytes as are available (at most the buffer). */
+	    returnval = read ( r->fd, r->bf, sizeof(r->bf) );
+	    if ( returnval < 0 && errno == EINTR ) continue;
+	    if ( returnval <= 0 ) { return returnval; }
+	    r->start = 0;
+	    r->end = returnval;
+	}
+	/* copy up to (and including) the next \n, or all that is buffered if there is none. */
+	nl = memchr ( r->bf + r->start, '\n', r->end - r->start );
+	take = nl != NULL ? (size_t)(nl + 1 - (r->bf + r->start)) : r->end - r->start;
+	if ( take > MAX_LINE - n ) take = MAX_LINE - n;
+	memcpy ( bf + n, r->bf + r->start, take );
+	r->start += take;
+	n += take;
+	if ( bf[n - 1] == '\n' ) { return n; }
+    }
+    return 0; // no newline found.
+}
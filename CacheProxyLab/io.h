@@ -1,6 +1,26 @@
+#ifndef IO_H
+#define IO_H
+
 #include <stddef.h>
+#include <sys/uio.h>
 
 #define MAX_LINE 8192 // HTTP Semantics (RFC 9110) recommends >= 8000 characters.
 
+/* reads lines from an fd through a buffer, taking whatever the fd has ready in one `read`
+   (read_line takes one `read` per byte). bytes past the last line stay in the buffer. */
+typedef struct line_reader
+{
+    int fd;
+    size_t start;      // next unread byte in bf
+    size_t end;        // end of the bytes read into bf
+    char bf[MAX_LINE];
+} line_reader;
+
 int read_line ( int fd, char* bf );
+void line_reader_init ( line_reader *r, int fd );
+int read_line_buffered ( line_reader *r, char* bf );
+ssize_t read_all ( int fd, void *bf, size_t n );
 ssize_t write_all ( int fd, void *bf, size_t n) ;
+ssize_t writev_all ( int fd, struct iovec *iov, int iovcnt );
+
+#endif/*IO_H*/
@@ -0,0 +1,279 @@
+/*
+A load generator for the proxy (pair it with stuborigin.c for offline runs).
+
+Replays a Zipf-distributed workload over a fixed set of URLs through the proxy,
+from a number of concurrent client threads (one request per connection, like
+the proxy expects), and reports throughput, cache hit ratio and latency
+percentiles. A response is counted as a hit when it carries an `X-Stub-Serial`
+the stub origin already handed out for that URL, i.e. the proxy replayed it.
+
+usage: ./loadgen [-c concurrency] [-n requests] [-u urls] [-z zipf_exponent]
+                 [-o origin_host:port] [-r seed] <proxy_host> <proxy_port>
+ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include "io.h"
+
+#define RESPONSE_BUF 65536
+
+/* workload */
+static int concurrency = 16;
+static long requests = 10000;
+static int urls = 1000;
+static double zipf_s = 0.9;
+static char *origin = "127.0.0.1:18080";
+static unsigned int seed = 1;
+static char *proxy_host;
+static char *proxy_port;
+
+static double *zipf_cdf;             // zipf_cdf[i] = P(url <= i)
+static unsigned long *last_serial;   // per URL: the serial of the last response seen
+static long next_request = 0;        // requests handed out to client threads so far
+
+typedef struct client
+{
+    pthread_t tid;
+    unsigned int rand_state;
+    long done;                // requests completed
+    long hits;                // of which were served from the proxy's cache
+    long errors;              // requests that failed (connect, write, or no response)
+    unsigned long long bytes; // response bytes received
+    double *latency_ms;       // latency of each completed request
+} client;
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* Precompute the CDF of a Zipf(s) distribution over `urls` ranks. */
+static void init_zipf()
+{
+    int i;
+    double sum = 0;
+
+    zipf_cdf = malloc(urls * sizeof(double));
+    last_serial = calloc(urls, sizeof(unsigned long));
+    for (i = 0; i < urls; i++)
+    {
+        sum += 1.0 / pow(i + 1, zipf_s);
+        zipf_cdf[i] = sum;
+    }
+    for (i = 0; i < urls; i++)
+        zipf_cdf[i] /= sum;
+}
+
+/* Draw a URL rank (0 is the most popular) by binary search in the CDF. */
+static int next_url(client *c)
+{
+    double u = (double)rand_r(&c->rand_state) / ((double)RAND_MAX + 1);
+    int lo = 0, hi = urls - 1;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int connect_proxy()
+{
+    struct addrinfo hints, *ai, *curr;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(proxy_host, proxy_port, &hints, &ai) != 0)
+        return -1;
+    for (curr = ai; curr != NULL; curr = curr->ai_next)
+    {
+        fd = socket(curr->ai_family, curr->ai_socktype, curr->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, curr->ai_addr, curr->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(ai);
+    return fd;
+}
+
+/* Issue one request for URL `id`. Returns the response length, or -1 on failure.
+   Sets *hit if the response was a replay of one seen before. */
+static long do_request(client *c, int id, char *response, int *hit)
+{
+    char request[MAX_LINE];
+    long total = 0, n;
+    unsigned long serial = 0, prev;
+    char *field;
+    int fd, len;
+
+    if ((fd = connect_proxy()) < 0)
+        return -1;
+
+    len = snprintf(request, sizeof(request),
+                   "GET http://%s/obj/%d HTTP/1.0\r\nHost: %s\r\n\r\n", origin, id, origin);
+    if (write_all(fd, request, len) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    /* read until EOF; only the beginning (the header) is kept. */
+    while ((n = read(fd, response + (total < RESPONSE_BUF - 1 ? total : 0),
+                     total < RESPONSE_BUF - 1 ? RESPONSE_BUF - 1 - total : RESPONSE_BUF - 1)) > 0)
+        total += n;
+    close(fd);
+    if (n < 0 || total == 0)
+        return -1;
+
+    response[total < RESPONSE_BUF - 1 ? total : RESPONSE_BUF - 1] = '\0';
+    if ((field = strstr(response, "X-Stub-Serial: ")) != NULL)
+        serial = strtoul(field + strlen("X-Stub-Serial: "), NULL, 10);
+
+    /* a serial we've seen for this URL before means the proxy served it from its cache. */
+    prev = __atomic_load_n(&last_serial[id], __ATOMIC_RELAXED);
+    *hit = serial != 0 && serial == prev;
+    if (serial != 0 && !*hit)
+        __atomic_compare_exchange_n(&last_serial[id], &prev, serial, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    return total;
+}
+
+void *clientLoop(void *args)
+{
+    client *c = args;
+    char *response = malloc(RESPONSE_BUF);
+    double start;
+    long total;
+    int hit;
+
+    while (__atomic_fetch_add(&next_request, 1, __ATOMIC_RELAXED) < requests)
+    {
+        start = now_ms();
+        total = do_request(c, next_url(c), response, &hit);
+        if (total < 0)
+        {
+            c->errors++;
+            continue;
+        }
+        c->latency_ms[c->done++] = now_ms() - start;
+        c->hits += hit;
+        c->bytes += total;
+    }
+    free(response);
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double *sorted, long n, double p)
+{
+    long i = (long)(p * n);
+    if (n == 0)
+        return 0;
+    return sorted[i < n ? i : n - 1];
+}
+
+int main(int argc, char **argv)
+{
+    int opt, i;
+    client *clients;
+    double start, elapsed;
+    long done = 0, hits = 0, errors = 0, k = 0;
+    unsigned long long bytes = 0;
+    double *all;
+
+    while ((opt = getopt(argc, argv, "c:n:u:z:o:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            concurrency = atoi(optarg);
+            break;
+        case 'n':
+            requests = atol(optarg);
+            break;
+        case 'u':
+            urls = atoi(optarg);
+            break;
+        case 'z':
+            zipf_s = atof(optarg);
+            break;
+        case 'o':
+            origin = optarg;
+            break;
+        case 'r':
+            seed = atoi(optarg);
+            break;
+        default:
+            optind = argc; // print usage
+        }
+    }
+    if (argc - optind != 2 || concurrency <= 0 || urls <= 0 || requests <= 0)
+    {
+        fprintf(stderr, "usage: %s [-c concurrency] [-n requests] [-u urls] [-z zipf_exponent]\n"
+                        "          [-o origin_host:port] [-r seed] <proxy_host> <proxy_port>\n",
+                argv[0]);
+        exit(1);
+    }
+    proxy_host = argv[optind];
+    proxy_port = argv[optind + 1];
+
+    init_zipf();
+    clients = calloc(concurrency, sizeof(client));
+
+    start = now_ms();
+    for (i = 0; i < concurrency; i++)
+    {
+        clients[i].rand_state = seed + i;
+        clients[i].latency_ms = malloc(requests * sizeof(double));
+        pthread_create(&clients[i].tid, NULL, clientLoop, &clients[i]);
+    }
+    for (i = 0; i < concurrency; i++)
+    {
+        pthread_join(clients[i].tid, NULL);
+        done += clients[i].done;
+        hits += clients[i].hits;
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+    }
+    elapsed = (now_ms() - start) / 1000.0;
+
+    all = malloc((done ? done : 1) * sizeof(double));
+    for (i = 0; i < concurrency; i++)
+    {
+        memcpy(all + k, clients[i].latency_ms, clients[i].done * sizeof(double));
+        k += clients[i].done;
+    }
+    qsort(all, done, sizeof(double), compare_double);
+
+    printf("requests   %ld ok, %ld errors, concurrency %d, %d urls, zipf %.2f\n",
+           done, errors, concurrency, urls, zipf_s);
+    printf("throughput %.1f req/s, %.2f MB/s over %.2fs\n",
+           done / elapsed, bytes / elapsed / 1e6, elapsed);
+    printf("hit ratio  %.3f\n", done ? (double)hits / done : 0.0);
+    printf("latency    p50 %.3fms  p99 %.3fms  p999 %.3fms  max %.3fms\n",
+           percentile(all, done, 0.50), percentile(all, done, 0.99),
+           percentile(all, done, 0.999), done ? all[done - 1] : 0.0);
+    return 0;
+}
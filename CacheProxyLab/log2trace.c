@@ -0,0 +1,76 @@
+/*
+Converts an access log written by the proxy (-l) into a replay trace for cachesim:
+
+    <timestamp> <size> <request line>
+
+one line per logged request, in log order. With -a, every field of every record
+is printed instead (thread, hit/miss, origin and total time), for a quick look.
+
+usage: ./log2trace [-a] <access log>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "accesslog.h"
+
+int main(int argc, char **argv)
+{
+    FILE *in;
+    access_record record;
+    char magic[sizeof(ACCESS_LOG_MAGIC) - 1];
+    char line[UINT16_MAX + 1];
+    long records = 0, hits = 0;
+    int opt, all = 0;
+
+    while ((opt = getopt(argc, argv, "a")) != -1)
+    {
+        if (opt == 'a')
+            all = 1;
+        else
+            optind = argc; // print usage
+    }
+    if (argc - optind != 1)
+    {
+        fprintf(stderr, "usage: %s [-a] <access log>\n", argv[0]);
+        exit(1);
+    }
+    if ((in = fopen(argv[optind], "rb")) == NULL)
+    {
+        perror(argv[optind]);
+        exit(1);
+    }
+    if (fread(magic, sizeof(magic), 1, in) != 1 || memcmp(magic, ACCESS_LOG_MAGIC, sizeof(magic)))
+    {
+        fprintf(stderr, "%s: not an access log\n", argv[optind]);
+        exit(1);
+    }
+
+    while (fread(&record, sizeof(record), 1, in) == 1)
+    {
+        if (fread(line, 1, record.line_len, in) != record.line_len)
+        {
+            fprintf(stderr, "%s: truncated record %ld\n", argv[optind], records);
+            break;
+        }
+        line[record.line_len] = '\0';
+        records++;
+        hits += record.hit;
+
+        if (all)
+            printf("%llu.%06llu tid %u %s %u bytes origin %.3fms total %.3fms %s\n",
+                   (unsigned long long)record.timestamp_us / 1000000,
+                   (unsigned long long)record.timestamp_us % 1000000,
+                   record.thread_id, record.hit ? "hit " : "miss", record.bytes,
+                   record.origin_us / 1000.0, record.total_us / 1000.0, line);
+        else
+            printf("%llu.%06llu %u %s\n",
+                   (unsigned long long)record.timestamp_us / 1000000,
+                   (unsigned long long)record.timestamp_us % 1000000,
+                   record.bytes, line);
+    }
+    fclose(in);
+    fprintf(stderr, "%ld records, %ld hits\n", records, hits);
+    return 0;
+}
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "origin.h"
+
+// Hash table of the origins seen so far (see sweep).
+static origin *buckets[ORIGIN_BUCKETS];
+static int origins = 0;                // in the table
+static int sweep_at = MAX_ORIGINS;     // sweep the table when a new origin would make it this many
+// One lock guards the table and all the counters in it; it is only held for a few instructions.
+static pthread_mutex_t origins_lock = PTHREAD_MUTEX_INITIALIZER;
+static int limit = DEFAULT_MAX_PER_ORIGIN;
+static int negative_ttl = DEFAULT_NEGATIVE_TTL;
+
+// (monotonic: a TTL or wait mustn't jump when the system clock is set)
+static unsigned long long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned int hash_origin(char *hostname, char *port)
+{
+    // FNV-1a over "hostname:port"
+    unsigned int h = 2166136261u;
+    for (; *hostname; hostname++)
+        h = (h ^ (unsigned char)*hostname) * 16777619u;
+    h = (h ^ ':') * 16777619u;
+    for (; *port; port++)
+        h = (h ^ (unsigned char)*port) * 16777619u;
+    return h % ORIGIN_BUCKETS;
+}
+
+void init_origins(int max_per_origin, int ttl)
+{
+    if (max_per_origin > 0)
+        limit = max_per_origin;
+    if (ttl >= 0)
+        negative_ttl = ttl;
+}
+
+// Find the origin for (hostname, port); NULL if no request has gone to it yet.
+// Caller must hold origins_lock.
+static origin *find(char *hostname, char *port)
+{
+    origin *o;
+
+    for (o = buckets[hash_origin(hostname, port)]; o != NULL; o = o->next)
+    {
+        if (!strcmp(o->hostname, hostname) && !strcmp(o->port, port))
+            return o;
+    }
+    return NULL;
+}
+
+// Forget the origins no request is using or waiting for, and that aren't failing; then don't
+// sweep again until the table has doubled (or is at MAX_ORIGINS again), so that a table full of
+// origins in use isn't swept for every new one. Caller must hold origins_lock.
+static void sweep(void)
+{
+    unsigned long long now = now_us();
+    origin **link, *o;
+    int i;
+
+    for (i = 0; i < ORIGIN_BUCKETS; i++)
+    {
+        for (link = &buckets[i]; (o = *link) != NULL;)
+        {
+            if (o->active > 0 || o->next_ticket != o->now_serving || o->failing_until > now)
+            {
+                link = &o->next;
+                continue;
+            }
+            *link = o->next;
+            pthread_cond_destroy(&o->turn);
+            free(o->hostname);
+            free(o->port);
+            free(o);
+            origins--;
+        }
+    }
+    sweep_at = origins * 2 > MAX_ORIGINS ? origins * 2 : MAX_ORIGINS;
+}
+
+// Find the origin for (hostname, port), creating it if this is the first request to it.
+// Caller must hold origins_lock.
+static origin *lookup(char *hostname, char *port)
+{
+    unsigned int h = hash_origin(hostname, port);
+    origin *o;
+
+    if ((o = find(hostname, port)) != NULL)
+        return o;
+    if (origins >= sweep_at)
+        sweep();
+
+    if ((o = calloc(1, sizeof(origin))) == NULL ||
+        (o->hostname = strdup(hostname)) == NULL ||
+        (o->port = strdup(port)) == NULL)
+    {
+        fprintf(stderr, "allocate failed\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_cond_init(&o->turn, NULL);
+    o->next = buckets[h];
+    buckets[h] = o;
+    origins++;
+    return o;
+}
+
+// Account for the connections held since active last changed (it is about to).
+// Caller must hold origins_lock.
+static void busy(origin *o)
+{
+    unsigned long long now = now_us();
+    if (o->changed_us != 0)
+        o->busy_us += (now - o->changed_us) * o->active;
+    o->changed_us = now;
+}
+
+// Block until this request may open a connection to (hostname, port).
+// Requests are admitted strictly in arrival order: each takes a ticket, and waits
+// until its ticket is the one being served and a connection slot is free.
+origin *origin_acquire(char *hostname, char *port)
+{
+    origin *o;
+    unsigned long ticket;
+    unsigned long depth;
+    unsigned long long start, waited;
+
+    pthread_mutex_lock(&origins_lock);
+    o = lookup(hostname, port);
+
+    ticket = o->next_ticket++;
+    depth = o->next_ticket - o->now_serving;
+    if (depth > o->max_depth)
+        o->max_depth = depth;
+
+    if (ticket != o->now_serving || o->active >= limit)
+    {
+        start = now_us();
+        while (ticket != o->now_serving || o->active >= limit)
+            pthread_cond_wait(&o->turn, &origins_lock);
+        waited = now_us() - start;
+
+        o->queued++;
+        o->wait_us += waited;
+        if (waited > o->max_wait_us)
+            o->max_wait_us = waited;
+    }
+
+    o->now_serving++;
+    busy(o);
+    o->active++;
+    o->admitted++;
+    // the next ticket in line may be admissible too (if more than one slot is free).
+    pthread_cond_broadcast(&o->turn);
+    pthread_mutex_unlock(&origins_lock);
+    return o;
+}
+
+// Give back the connection slot taken by origin_acquire.
+void origin_release(origin *o)
+{
+    pthread_mutex_lock(&origins_lock);
+    busy(o);
+    o->active--;
+    pthread_cond_broadcast(&o->turn);
+    pthread_mutex_unlock(&origins_lock);
+}
+
+// If (hostname, port) failed less than negative_ttl seconds ago, return the status to answer
+// requests to it with (and the seconds until it may be tried again); otherwise 0.
+int origin_failing(char *hostname, char *port, int *retry_after)
+{
+    origin *o;
+    unsigned long long now;
+    int status = 0;
+
+    pthread_mutex_lock(&origins_lock);
+    o = find(hostname, port);
+    if (o != NULL && o->failing_until > (now = now_us()))
+    {
+        status = o->failure_status;
+        *retry_after = (o->failing_until - now + 999999) / 1000000;
+        o->fast_failed++;
+    }
+    pthread_mutex_unlock(&origins_lock);
+    return status;
+}
+
+// Remember that a request to (hostname, port) failed with status, so the next ones fail fast.
+// (By name: the request may have given back its connection slot, and so its origin, already.)
+void origin_failed(char *hostname, char *port, int status)
+{
+    origin *o;
+
+    if (negative_ttl == 0)
+        return;
+    pthread_mutex_lock(&origins_lock);
+    o = lookup(hostname, port);
+    o->failing_until = now_us() + (unsigned long long)negative_ttl * 1000000;
+    o->failure_status = status;
+    o->failures++;
+    pthread_mutex_unlock(&origins_lock);
+}
+
+// Print one line of metrics per origin.
+void origin_report(FILE *out)
+{
+    int i;
+    origin *o;
+
+    pthread_mutex_lock(&origins_lock);
+    for (i = 0; i < ORIGIN_BUCKETS; i++)
+    {
+        for (o = buckets[i]; o != NULL; o = o->next)
+        {
+            busy(o);
+            fprintf(out, "origin %s:%s active %d/%d queue %lu (max %lu) admitted %lu queued %lu wait avg %.1fms max %.1fms held avg %.1fms failures %lu fast-failed %lu%s\n",
+                    o->hostname, o->port, o->active, limit,
+                    o->next_ticket - o->now_serving, o->max_depth,
+                    o->admitted, o->queued,
+                    o->queued ? o->wait_us / 1000.0 / o->queued : 0.0,
+                    o->max_wait_us / 1000.0,
+                    o->admitted ? o->busy_us / 1000.0 / o->admitted : 0.0,
+                    o->failures, o->fast_failed,
+                    o->failing_until > now_us() ? " (failing)" : "");
+        }
+    }
+    pthread_mutex_unlock(&origins_lock);
+}
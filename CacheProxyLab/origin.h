@@ -0,0 +1,49 @@
+/*
+Per-origin (host, port) bookkeeping, shared by all worker threads.
+Bounds how many connections the proxy keeps open to any one origin at a time;
+requests beyond the limit wait in a FIFO queue until a slot frees up.
+Also remembers origins that just failed (unreachable, timed out, or answering 5xx),
+so that for a few seconds requests to them get an error without trying again.
+Past MAX_ORIGINS of them, the idle ones (no connection open or waiting, not failing) are
+forgotten, metrics and all: any client can make up hostnames, and so new origins.
+An origin is only to be used between origin_acquire and origin_release.
+ */
+#include <stdio.h>
+#include <pthread.h>
+
+#define ORIGIN_BUCKETS 256
+#define DEFAULT_MAX_PER_ORIGIN 16
+#define DEFAULT_NEGATIVE_TTL 5 // seconds an origin failure is remembered
+#define MAX_ORIGINS 4096       // origins kept (more, while they are all in use)
+
+typedef struct origin
+{
+    char *hostname;
+    char *port;
+    int active;                // connections currently open to this origin
+    unsigned long next_ticket; // ticket handed to the next request that arrives
+    unsigned long now_serving; // oldest ticket that has not been admitted yet
+    pthread_cond_t turn;       // signalled whenever active or now_serving changes
+    unsigned long long failing_until; // until then (now_us), requests fail fast with failure_status
+    int failure_status;               // 502 (unreachable), 504 (timed out), or the 5xx it sent
+
+    /* metrics */
+    unsigned long admitted;  // requests that got a slot
+    unsigned long queued;    // of those, how many had to wait for it
+    unsigned long max_depth; // deepest the wait queue has been
+    unsigned long long wait_us;     // total time spent waiting
+    unsigned long long max_wait_us; // longest single wait
+    unsigned long long busy_us;     // sum over time of active connections (connection-microseconds)
+    unsigned long long changed_us;  // when active last changed
+    unsigned long failures;    // failures remembered
+    unsigned long fast_failed; // requests answered with failure_status instead
+
+    struct origin *next; // next origin in the same bucket
+} origin;
+
+void init_origins(int max_per_origin, int negative_ttl);
+origin *origin_acquire(char *hostname, char *port);
+void origin_release(origin *o);
+int origin_failing(char *hostname, char *port, int *retry_after);
+void origin_failed(char *hostname, char *port, int status);
+void origin_report(FILE *out);
@@ -2,6 +2,7 @@
  * @author Jacob Grum <jacg@itu.dk>
  */
 
+#define _GNU_SOURCE // pthread_setaffinity_np
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netdb.h>
@@ -12,7 +13,25 @@
 #include <errno.h>
 #include <pthread.h>
 #include <bits/pthreadtypes.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <limits.h>
 #include "cache.h"
+#include "origin.h"
+#include "accesslog.h"
+#include "compress.h"
+#include "uring.h"
+#include "tunnel.h"
+#include "admin.h"
+#include "arena.h"
+#include "clients.h"
 
 /* The source code for the proxy is split across three files (including this one). */
 #include "proxy.h" // proxy
@@ -20,70 +39,877 @@
 #include "http.h"  // http-related things for ^
 #include "io.h"    // io-related things for ^
 
-// rwlock used to let in readers concurrently, but stop concurrency when writing.
-static pthread_rwlock_t rwlock;
+// Command line options (see parse_options).
+proxy_options options = {
+    .max_per_origin = DEFAULT_MAX_PER_ORIGIN,
+    .stats_interval = STATS_INTERVAL,
+    .connect_timeout = CONNECT_TIMEOUT,
+    .acceptors = 1,
+    .negative_ttl = DEFAULT_NEGATIVE_TTL,
+    .drain_timeout = DRAIN_TIMEOUT,
+    .snapshot_interval = SNAPSHOT_INTERVAL,
+    .relay_buffer = RELAY_BUFFER,
+    .numa_node = -1,
+    .max_workers = MAX_WORKERS,
+    .connect_ports = CONNECT_PORTS,
+};
+
+/* microseconds on a clock that never jumps (unlike the wall clock). */
+static long long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* milliseconds, on the same clock. */
+static long long now_ms()
+{
+    return now_us() / 1000;
+}
+
+// One listening socket + accept loop per acceptor thread (see acceptLoop, acceptLoopUring).
+typedef struct acceptor
+{
+    int id;
+    int listen_fd;
+    unsigned long accepted; // connections accepted so far (only this acceptor's thread writes it)
+    unsigned long reported; // value of accepted at the previous stats report
+    unsigned long failed;   // accepts that failed (see accept_failed) ...
+    unsigned long shed;     // ... and connections closed unserved, for want of a file descriptor
+    int spare_fd;           // a file descriptor kept open, to be given up for shedding one
+} acceptor;
+
+static acceptor acceptors[MAX_ACCEPTORS];
+static pthread_t acceptor_threads[MAX_ACCEPTORS];
+
+/* Stopping: a byte written to wake_pipe makes every accept loop return; then the
+   connections still being handled (active_connections) get a while to finish. */
+static int wake_pipe[2];
+static int active_connections = 0;
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t connections_done = PTHREAD_COND_INITIALIZER; // signalled when it drops to 0
+
+/* Worker threads are detached, and have small stacks (WORKER_STACK_SIZE; see connection). */
+static pthread_attr_t worker_attr;
 
 /*
-Correct passing of thread arguments: Producer Consumer Model
-Allocate in main
-Free in thread routine
+Passing of thread arguments: the fd (and its client's slot, see clients.h) is passed by value,
+smuggled in the pointer itself (the slot in its low SLOT_BITS), so the accept loop doesn't need
+to allocate (and the worker free) anything. handle_connection_request closes the fd.
+Once done with it, the worker goes on with the connections waiting for one (see clients_next),
+unless it left the workers meanwhile (see worker_leave).
 */
+#define SLOT_BITS 12
+_Static_assert(CLIENT_SLOTS <= 1 << SLOT_BITS, "a client's slot must fit in SLOT_BITS");
+
+static __thread int worker_slot; // client of the connection this worker handles (-1: it left the workers)
+
+static void start_spare_workers(void);
+
 void *threadWorker(void *args)
 {
-    int client_fd = *((int *)args);
-    pthread_detach(pthread_self());
-    free(args);
-    handle_connection_request(client_fd);
+    int client_fd = (int)((uintptr_t)args >> SLOT_BITS);
+
+    worker_slot = (int)((uintptr_t)args & ((1 << SLOT_BITS) - 1));
+    do
+    {
+        handle_connection_request(client_fd);
+
+        pthread_mutex_lock(&connections_lock);
+        if (--active_connections == 0)
+            pthread_cond_signal(&connections_done);
+        pthread_mutex_unlock(&connections_lock);
+        if (worker_slot < 0)
+            break;
+        client_fd = clients_next(&worker_slot);
+        start_spare_workers();
+    } while (client_fd >= 0);
+    return NULL;
+}
+
+/* Start a worker thread for a connection (client_fd) of the client in slot, admitted to be
+   handled (it counts as active already). If that fails, the connection is closed unserved. */
+static void spawn_worker(int client_fd, int slot)
+{
+    pthread_t tid;
+
+    if (pthread_create(&tid, &worker_attr, threadWorker, (void *)(((uintptr_t)client_fd << SLOT_BITS) | slot)) == 0)
+        return;
+    close(client_fd);
+    clients_abandon(slot);
+    pthread_mutex_lock(&connections_lock);
+    active_connections--;
+    pthread_mutex_unlock(&connections_lock);
+}
+
+/* Start a worker for each connection waiting that can have one now (see clients_spare). */
+static void start_spare_workers(void)
+{
+    int client_fd, slot;
+
+    while ((client_fd = clients_spare(&slot)) >= 0)
+        spawn_worker(client_fd, slot);
+}
+
+/* This worker's connection no longer counts against the workers (see clients_leave); the
+   connections waiting for one can have its place. */
+static void worker_leave(void)
+{
+    if (worker_slot < 0)
+        return;
+    clients_leave(worker_slot);
+    worker_slot = -1;
+    start_spare_workers();
+}
+
+/* Answer a connection that won't be handled (its client is over its rate: 429; or too many are
+   waiting for a worker: 503) right away, without reading its request, and close it.
+   NOTE: the request unread, the client may get a reset instead (it is told off either way). */
+static void turn_away(int client_fd, int status)
+{
+    char resp_storage[256];
+    strbuf resp;
+
+    strbuf_init(&resp, resp_storage, sizeof(resp_storage));
+    if (set_origin_error_response(&resp, status, 1))
+        send(client_fd, resp.data, resp.len, MSG_DONTWAIT | MSG_NOSIGNAL);
     close(client_fd);
+}
+
+/* Hand a connection just accepted from peer (NULL: look it up) to a new worker thread, or have
+   it wait for one (see clients.h); it counts as active until it is done.
+   (A failed accept, client_fd < 0, is no connection: accept_failed counts those.) */
+static void start_worker(acceptor *self, int client_fd, struct sockaddr *peer)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    int slot, status;
+
+    if (client_fd < 0)
+        return;
+    __atomic_fetch_add(&self->accepted, 1, __ATOMIC_RELAXED);
+    if (peer == NULL)
+    {
+        memset(&addr, 0, sizeof(addr));
+        if (getpeername(client_fd, (struct sockaddr *)&addr, &len) < 0)
+            addr.ss_family = AF_INET; // (0.0.0.0)
+        peer = (struct sockaddr *)&addr;
+    }
+
+    pthread_mutex_lock(&connections_lock);
+    active_connections++;
+    pthread_mutex_unlock(&connections_lock);
+    status = clients_admit(peer, client_fd, &slot);
+    if (status == CLIENT_QUEUED)
+        return;
+    if (status == CLIENT_RUN)
+    {
+        spawn_worker(client_fd, slot);
+        return;
+    }
+
+    turn_away(client_fd, status == CLIENT_LIMITED ? 429 : 503);
+    pthread_mutex_lock(&connections_lock);
+    active_connections--;
+    pthread_mutex_unlock(&connections_lock);
+}
+
+/* With several acceptors, pin each to its own core, so their queues are served in parallel.
+   With -N, those are the cores of that NUMA node (a single acceptor may use any of them), the
+   node the cache's memory is on; the workers an acceptor starts run where it does. */
+static void pin_acceptor(acceptor *self)
+{
+    cpu_set_t cpus;
+    int node_cpus[CPU_SETSIZE];
+    int i, n;
+
+    CPU_ZERO(&cpus);
+    if (options.numa_node >= 0 && (n = arena_node_cpus(options.numa_node, node_cpus, CPU_SETSIZE)) > 0)
+    {
+        if (options.acceptors > 1)
+            CPU_SET(node_cpus[self->id % n], &cpus);
+        else
+            for (i = 0; i < n; i++)
+                CPU_SET(node_cpus[i], &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+    else if (options.acceptors > 1)
+    {
+        CPU_SET(self->id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+}
+
+/* Close the connection at the head of the listening socket's queue unserved: out of file
+   descriptors, it couldn't be accepted, and its client would otherwise wait in the queue (as
+   would all behind it) until it gave up. The spare fd is given up to accept it, and taken back. */
+static void shed_connection(acceptor *self)
+{
+    struct pollfd ready = {self->listen_fd, POLLIN, 0};
+    int fd;
+
+    close(self->spare_fd);
+    if (poll(&ready, 1, 0) > 0 && (fd = accept4(self->listen_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+    {
+        close(fd);
+        __atomic_fetch_add(&self->shed, 1, __ATOMIC_RELAXED);
+    }
+    self->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/* An accept failed (errno says why). Returns how long (ms) the accept loop is to pause before
+   it accepts again, having paused backoff ms after the previous failure (0: it succeeded):
+   - out of file descriptors (EMFILE, ENFILE) or kernel memory (ENOBUFS, ENOMEM): doubling from
+     ACCEPT_BACKOFF_MIN to ACCEPT_BACKOFF_MAX, so that it doesn't spin while connections finish
+     and give theirs back; a connection is shed (see shed_connection) every time;
+   - the connection failed before it could be accepted (e.g. ECONNABORTED): 0, on to the next;
+   - the listening socket itself is unusable (see error_accept_fatal): -1, the loop stops.
+   Whatever happens, the proxy (and the connections it has) keeps going. */
+static int accept_failed(acceptor *self, int backoff)
+{
+    int err = errno;
+
+    __atomic_fetch_add(&self->failed, 1, __ATOMIC_RELAXED);
+    if (error_accept_fatal(-1))
+        return -1;
+    if (err != EMFILE && err != ENFILE && err != ENOBUFS && err != ENOMEM)
+        return 0;
+    if (err == EMFILE || err == ENFILE)
+        shed_connection(self);
+    if (backoff == 0)
+        return ACCEPT_BACKOFF_MIN;
+    return backoff * 2 < ACCEPT_BACKOFF_MAX ? backoff * 2 : ACCEPT_BACKOFF_MAX;
+}
+
+/* Accept connection requests on one listening socket, and hand each to a new worker thread,
+   until the proxy stops (see stop_accepting).
+   Kept as lean as possible (no printing, no allocation); it is the only thing this thread does. */
+void *acceptLoop(void *args)
+{
+    acceptor *self = args;
+    int client_fd;
+    int backoff = 0; // ms to pause before accepting again (see accept_failed)
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+    struct pollfd ready[2] = {{self->listen_fd, POLLIN, 0}, {wake_pipe[0], POLLIN, 0}};
+
+    pin_acceptor(self);
+
+    /* accept only once poll says there is a connection (or we are told to stop), and
+       never block in it: the connection may be gone again by the time we get to it. */
+    fcntl(self->listen_fd, F_SETFL, fcntl(self->listen_fd, F_GETFL) | O_NONBLOCK);
+
+    while (1)
+    {
+        if (backoff > 0)
+        {
+            /* pausing: only a stop is looked at meanwhile. */
+            if (poll(&ready[1], 1, backoff) > 0)
+                break; // stopping.
+        }
+        else
+        {
+            if (poll(ready, 2, -1) < 0)
+                continue; // EINTR
+            if (ready[1].revents)
+                break; // stopping.
+        }
+
+        /* (close-on-exec, as every fd of ours: a hot-restarted proxy must not inherit connections; see hot_restart) */
+        peer_len = sizeof(peer);
+        client_fd = accept4(self->listen_fd, (struct sockaddr *)&peer, &peer_len, SOCK_CLOEXEC);
+        if (client_fd >= 0)
+        {
+            backoff = 0;
+            start_worker(self, client_fd, (struct sockaddr *)&peer);
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            backoff = 0;
+        }
+        else if ((backoff = accept_failed(self, backoff)) < 0)
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+enum { URING_ACCEPT = 1, URING_WAKE }; // what an io_uring completion is for (its user_data)
+
+/* acceptLoop on an io_uring (-U): one multishot accept stays armed on the listening socket,
+   and each io_uring_enter both re-arms what needs re-arming and collects every connection
+   accepted meanwhile, instead of a poll and an accept per connection.
+   Falls back to acceptLoop if the kernel has no io_uring (or no multishot accept, < 5.19). */
+void *acceptLoopUring(void *args)
+{
+    acceptor *self = args;
+    uring ring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    int armed = 0, stopping = 0;
+    int backoff = 0; // (as in acceptLoop)
+
+    if (uring_init(&ring, 8) < 0)
+    {
+        fprintf(stderr, "\033[31mfailure:\033[0m set up io_uring. accepting with poll instead.\n");
+        return acceptLoop(args);
+    }
+    pin_acceptor(self);
+
+    /* told to stop: the wake pipe becomes readable. */
+    sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = wake_pipe[0];
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_WAKE;
+
+    while (!stopping)
+    {
+        /* the kernel ends a multishot accept on errors (and when it runs out of room to post
+           completions); it is armed again here. */
+        if (!armed)
+        {
+            /* (after a failure, pausing as acceptLoop does; the wake pipe ends that too.) */
+            if (backoff > 0 && poll(&(struct pollfd){wake_pipe[0], POLLIN, 0}, 1, backoff) > 0)
+                break;
+            sqe = uring_get_sqe(&ring);
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = self->listen_fd;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_CLOEXEC; // (as acceptLoop's accept4; see hot_restart)
+            sqe->user_data = URING_ACCEPT;
+            armed = 1;
+        }
+        if (uring_submit_and_wait(&ring, 1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "\033[31mfailure:\033[0m io_uring_enter. accepting with poll instead.\n");
+            uring_exit(&ring);
+            return acceptLoop(args);
+        }
+        while ((cqe = uring_peek_cqe(&ring)) != NULL)
+        {
+            if (cqe->user_data == URING_WAKE)
+            {
+                stopping = 1;
+            }
+            else
+            {
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                    armed = 0;
+                if (cqe->res == -EINVAL && !armed)
+                {
+                    /* no multishot accept in this kernel. */
+                    uring_exit(&ring);
+                    fprintf(stderr, "\033[31mfailure:\033[0m multishot accept. accepting with poll instead.\n");
+                    return acceptLoop(args);
+                }
+                if (cqe->res >= 0)
+                {
+                    backoff = 0;
+                    start_worker(self, cqe->res, NULL); // (a multishot accept gives no address)
+                }
+                else if (cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECANCELED)
+                {
+                    errno = -cqe->res;
+                    if ((backoff = accept_failed(self, backoff)) < 0)
+                        stopping = 1;
+                }
+            }
+            uring_cqe_seen(&ring);
+        }
+    }
+    uring_exit(&ring); // (cancels the accept)
+    return NULL;
+}
+
+/* Make all accept loops return, and wait until they have. */
+static void stop_accepting()
+{
+    int i;
+
+    write_all(wake_pipe[1], "x", 1);
+    for (i = 0; i < options.acceptors; i++)
+    {
+        pthread_join(acceptor_threads[i], NULL);
+    }
+}
+
+/* Wait (at most seconds) for the connections still being handled to finish.
+   Returns how many are left. */
+static int drain(int seconds)
+{
+    struct timespec deadline;
+    int left;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += seconds;
+
+    pthread_mutex_lock(&connections_lock);
+    while (active_connections > 0 &&
+           pthread_cond_timedwait(&connections_done, &connections_lock, &deadline) != ETIMEDOUT)
+        ;
+    left = active_connections;
+    pthread_mutex_unlock(&connections_lock);
+    return left;
+}
+
+/* The program execvp would run for file: file itself if it has a slash in it, otherwise the
+   first executable file of that name in a PATH directory (into path, of size bytes).
+   Returns file if there is none (execve fails then, as execvp would). */
+static char *program_path(char *file, char *path, size_t size)
+{
+    char *dirs = getenv("PATH");
+    size_t n;
+
+    if (strchr(file, '/') != NULL || dirs == NULL)
+        return file;
+    while (*dirs != '\0')
+    {
+        n = strcspn(dirs, ":");
+        if (snprintf(path, size, "%.*s/%s", (int)n, n > 0 ? dirs : ".", file) < (int)size &&
+            access(path, X_OK) == 0)
+            return path;
+        dirs += n;
+        if (*dirs == ':')
+            dirs++;
+    }
+    return file;
+}
+
+/* Hot restart: start a new proxy (same binary path and arguments) and hand it our listening
+   sockets (SCM_RIGHTS over a socketpair) and a snapshot of the cache. Both processes accept
+   until the new one is ready; connections that arrive meanwhile wait in the (shared) queues.
+   Every other fd of ours is close-on-exec, so the new proxy has none of our connections.
+   Returns 0 once the new proxy has taken over, or -1 if it didn't (and we carry on). */
+static int hot_restart(char **argv)
+{
+    int sv[2];
+    int fds[MAX_ACCEPTORS];
+    int i, j, n = options.acceptors;
+    char fd_var[sizeof(RESTART_FD_ENV) + 16];
+    char path_storage[PATH_MAX];
+    char *program;
+    char **envp;
+    char ready;
+    pid_t pid;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(fds))];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+
+    /* The new proxy keeps (only) its end of the socketpair across exec, and is told which fd
+       it is in its environment. All of that is made ready here: between fork and exec, the
+       child (a copy of a multithreaded process) may only make async-signal-safe calls. */
+    program = program_path(argv[0], path_storage, sizeof(path_storage));
+    for (i = 0; environ[i] != NULL; i++)
+        ;
+    if (fcntl(sv[1], F_SETFD, 0) < 0 || (envp = malloc((i + 2) * sizeof(char *))) == NULL)
+    {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    snprintf(fd_var, sizeof(fd_var), "%s=%d", RESTART_FD_ENV, sv[1]);
+    for (i = j = 0; environ[i] != NULL; i++)
+        if (strncmp(environ[i], RESTART_FD_ENV "=", sizeof(RESTART_FD_ENV)) != 0)
+            envp[j++] = environ[i];
+    envp[j++] = fd_var;
+    envp[j] = NULL;
+
+    pid = fork();
+    if (pid == 0)
+    {
+        /* the new proxy (it sets up its signal mask itself; see main). */
+        execve(program, argv, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(sv[1]);
+    if (pid < 0)
+    {
+        close(sv[0]);
+        return -1;
+    }
+
+    /* the listening sockets (and how many there are, as the one byte of data). */
+    for (i = 0; i < n; i++)
+        fds[i] = acceptors[i].listen_fd;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = &(char){n};
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+
+    if (sendmsg(sv[0], &msg, 0) < 0)
+        goto failed;
+
+    /* the cache (unless it is shared: then the new proxy has it already); then the new proxy
+       says it is accepting (if it doesn't, it died). */
+    i = 0;
+    if (options.shared_cache == NULL)
+    {
+        cache_rdlock();
+        i = cache_save(sv[0]);
+        cache_unlock();
+    }
+    if (i < 0 || shutdown(sv[0], SHUT_WR) < 0 || read(sv[0], &ready, 1) != 1)
+        goto failed;
+    close(sv[0]);
+    printf("\e[1mhot restart: pid %d took over\e[0m\n", pid);
+    return 0;
+
+failed:
+    fprintf(stderr, "\033[31mfailure:\033[0m hot restart (pid %d). carrying on.\n", pid);
+    close(sv[0]);
+    waitpid(pid, NULL, WNOHANG);
+    return -1;
+}
+
+/* In a hot-restarted proxy: take over the listening sockets and the cache from the old one (over fd).
+   Returns 0, or -1 if the old proxy didn't send them. */
+static int take_over(int fd)
+{
+    int fds[MAX_ACCEPTORS];
+    int i;
+    char n;
+    long loaded;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(fds))];
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &n;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != 1 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+        cmsg->cmsg_type != SCM_RIGHTS || n < 1 || cmsg->cmsg_len != CMSG_LEN(n * sizeof(int)))
+        return -1;
+    memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+
+    /* the sockets decide how many acceptors there are (the old proxy's -a). */
+    if (n != options.acceptors)
+        printf("taking over %d listening socket(s); ignoring -a %d.\n", n, options.acceptors);
+    options.acceptors = n;
+    for (i = 0; i < n; i++)
+    {
+        acceptors[i].id = i;
+        acceptors[i].listen_fd = fds[i];
+    }
+
+    if (options.shared_cache != NULL)
+    {
+        printf("\e[1mtook over %d listening socket(s); the cache is shared in %s\e[0m\n", n, options.shared_cache);
+        return 0;
+    }
+    loaded = cache_load(fd);
+    printf("\e[1mtook over %d listening socket(s) and %ld cached object(s)\e[0m\n", n, loaded < 0 ? 0 : loaded);
+    return 0;
+}
+
+/* Print each acceptor's connection rate since the previous report (interval seconds ago;
+   0: just the totals). */
+void acceptor_report(FILE *out, int interval)
+{
+    int i;
+    unsigned long accepted, failed, total = 0;
+
+    for (i = 0; i < options.acceptors; i++)
+    {
+        accepted = __atomic_load_n(&acceptors[i].accepted, __ATOMIC_RELAXED);
+        if (interval > 0)
+            fprintf(out, "acceptor %d accepted %lu (%.1f conn/s)\n", i, accepted,
+                    (double)(accepted - acceptors[i].reported) / interval);
+        else
+            fprintf(out, "acceptor %d accepted %lu\n", i, accepted);
+        failed = __atomic_load_n(&acceptors[i].failed, __ATOMIC_RELAXED);
+        if (failed > 0)
+            fprintf(out, "acceptor %d: %lu accepts failed, %lu connections shed for want of a file descriptor\n", i,
+                    failed, __atomic_load_n(&acceptors[i].shed, __ATOMIC_RELAXED));
+        total += accepted - acceptors[i].reported;
+        acceptors[i].reported = accepted;
+    }
+    if (interval > 0)
+        fprintf(out, "acceptors %d total %.1f conn/s\n", options.acceptors, (double)total / interval);
+}
+
+/* Print all metrics (see acceptor_report for interval). */
+static void report(int interval)
+{
+    printf("\e[1m---- stats ----\e[0m\n");
+    acceptor_report(stdout, interval);
+    clients_report(stdout, interval);
+    origin_report(stdout);
+    cache_rdlock();
+    cache_report(stdout);
+    cache_unlock();
+    fflush(stdout);
+}
+
+/* Periodically print metrics, for as long as the proxy runs. */
+void *statsReporter(void *args)
+{
+    pthread_detach(pthread_self());
+    while (1)
+    {
+        sleep(options.stats_interval);
+        report(options.stats_interval);
+    }
     return NULL;
 }
 
+/* Write the cache to the snapshot file (-s). */
+static void snapshot()
+{
+    long long start = now_us();
+    int return_cd;
+
+    cache_rdlock();
+    return_cd = cache_snapshot(options.snapshot);
+    cache_unlock();
+    if (return_cd < 0)
+        fprintf(stderr, "\033[31mfailure:\033[0m snapshot cache to %s. ignoring that.\n", options.snapshot);
+    else
+        printf("snapshot cache to %s in %.1fms.\n", options.snapshot, (now_us() - start) / 1000.0);
+}
+
+/* Periodically snapshot the cache, for as long as the proxy runs. */
+void *snapshotter(void *args)
+{
+    pthread_detach(pthread_self());
+    while (1)
+    {
+        sleep(options.snapshot_interval);
+        snapshot();
+    }
+    return NULL;
+}
+
+/* Parse the `-x value` options in front of the port number. Returns 0 on success. */
+int parse_options(int argc, char **argv)
+{
+    int opt, cpu;
+    while ((opt = getopt(argc, argv, "a:A:b:c:C:d:e:i:l:m:N:r:s:S:t:Uw:z")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            options.acceptors = atoi(optarg);
+            if (options.acceptors < 1 || options.acceptors > MAX_ACCEPTORS)
+                return 1;
+            break;
+        case 'A':
+            options.admin_port = atoi(optarg);
+            break;
+        case 'b':
+            options.relay_buffer = atoi(optarg);
+            if (options.relay_buffer < MAX_LINE)
+                return 1;
+            break;
+        case 'c':
+            options.max_per_origin = atoi(optarg);
+            break;
+        case 'C':
+            options.connect_ports = optarg;
+            break;
+        case 'd':
+            options.drain_timeout = atoi(optarg);
+            break;
+        case 'e':
+            options.negative_ttl = atoi(optarg);
+            break;
+        case 'i':
+            options.stats_interval = atoi(optarg);
+            break;
+        case 'l':
+            options.access_log = optarg;
+            break;
+        case 'm':
+            options.shared_cache = optarg;
+            break;
+        case 'N':
+            options.numa_node = atoi(optarg);
+            if (arena_node_cpus(options.numa_node, &cpu, 1) < 0)
+                return 1;
+            break;
+        case 'r':
+            if (sscanf(optarg, "%lf/%lf", &options.client_rate, &options.client_burst) < 1 || options.client_rate < 0)
+                return 1;
+            break;
+        case 's':
+            options.snapshot = optarg;
+            break;
+        case 'S':
+            options.snapshot_interval = atoi(optarg);
+            break;
+        case 't':
+            options.connect_timeout = atoi(optarg);
+            break;
+        case 'U':
+            options.uring = 1;
+            break;
+        case 'w':
+            options.max_workers = atoi(optarg);
+            break;
+        case 'z':
+            options.compress = 1;
+            break;
+        default:
+            return 1;
+        }
+    }
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
-    int listen_fd; // fd for connection requests from clients.
-    int *client_fd;
+    int i, sig, left;
+    int fresh = 1; // the cache starts out empty
     pthread_t tid;
+    sigset_t stop_signals;
+    char *restart_fd = getenv(RESTART_FD_ENV);
 
-    // init rwlock
-    if (pthread_rwlock_init(&rwlock, NULL) != 0)
+    /* Check command line args for options, and presence of a port number. */
+    if (parse_options(argc, argv) || error_args_fatal(argc, argv))
     {
-        fprintf(stderr, "%s: %s\n", "Init lock failed", strerror(errno));
-        exit(0);
+        exit(1);
     }
 
-    /* Check command line args for presence of a port number. */
-    if (error_args_fatal(argc, argv))
+    /* A client that hangs up mid-response must not kill the proxy (the write fails with EPIPE instead).
+       SIGTERM/SIGINT (stop) and SIGHUP (hot restart) are waited for by this thread, at the end of
+       main; block them before starting any other thread, so that none of those gets them. */
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGHUP);
+    pthread_sigmask(SIG_SETMASK, &stop_signals, NULL); // (not just added to: a hot restart inherits the old proxy's mask)
+
+    /* Create a `socket`, `bind` it to listen address, configure it to `listen` (for connection requests).
+       Or, if we are a hot restart, take over the old proxy's (and its cache). */
+    init_cache(options.numa_node);
+    if (options.shared_cache != NULL && cache_share(options.shared_cache, &fresh) < 0)
     {
+        fprintf(stderr, "\033[31mfailure:\033[0m map shared cache %s. fatal.\n", options.shared_cache);
         exit(1);
     }
+    init_origins(options.max_per_origin, options.negative_ttl);
+    clients_init(options.client_rate, options.client_burst > 0 ? options.client_burst : options.client_rate,
+                 options.max_workers);
+    init_access_log(options.access_log);
+    if (restart_fd != NULL)
+    {
+        unsetenv(RESTART_FD_ENV);
+        if (take_over(atoi(restart_fd)) < 0)
+        {
+            fprintf(stderr, "\033[31mfailure:\033[0m take over from the old proxy. fatal.\n");
+            exit(1);
+        }
+    }
+    else
+    {
+        /* With more than one acceptor, each gets its own socket bound to the same port
+           (SO_REUSEPORT), and the kernel spreads incoming connections across them. */
+        for (i = 0; i < options.acceptors; i++)
+        {
+            acceptors[i].id = i;
+            acceptors[i].listen_fd = create_listen_fd(atoi(argv[optind]), options.acceptors > 1);
+        }
+        /* Start warm, with what was cached when the previous proxy stopped
+           (unless the cache is shared, and other proxies have filled it already). */
+        if (options.snapshot != NULL && fresh)
+        {
+            long long start = now_us();
+            long restored = cache_restore(options.snapshot);
+            if (restored >= 0)
+                printf("\e[1mrestored %ld cached object(s) from %s in %.1fms\e[0m\n", restored,
+                       options.snapshot, (now_us() - start) / 1000.0);
+        }
+    }
+    if (pipe2(wake_pipe, O_CLOEXEC) < 0)
+    {
+        exit(1);
+    }
+    pthread_attr_init(&worker_attr);
+    pthread_attr_setstacksize(&worker_attr, WORKER_STACK_SIZE);
+    pthread_attr_setdetachstate(&worker_attr, PTHREAD_CREATE_DETACHED);
 
-    /* Create a `socket`, `bind` it to listen address, configure it to `listen` (for connection requests). */
-    init_cache();
-    listen_fd = create_listen_fd(atoi(argv[1]));
+    if (options.stats_interval > 0)
+    {
+        pthread_create(&tid, NULL, statsReporter, NULL);
+    }
+    if (options.snapshot != NULL && options.snapshot_interval > 0)
+    {
+        pthread_create(&tid, NULL, snapshotter, NULL);
+    }
+    if (options.admin_port > 0)
+    {
+        admin_start(options.admin_port);
+    }
 
-    /* Handle connection requests. */
-    while (1)
+    /* Handle connection requests, each acceptor on its own thread. */
+    printf("\e[1mawaiting connection requests on %d acceptor(s)...\e[0m\n", options.acceptors);
+    for (i = 0; i < options.acceptors; i++)
+    {
+        acceptors[i].spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC); // (see shed_connection)
+        pthread_create(&acceptor_threads[i], NULL, options.uring ? acceptLoopUring : acceptLoop, &acceptors[i]);
+    }
+    if (restart_fd != NULL)
     {
-        printf("\e[1mawaiting connection request...\e[0m\n");
-        client_fd = malloc(sizeof(int)); /* alloc memory of each thread to avoid race */
-        *client_fd = accept(listen_fd, (struct sockaddr *)NULL, NULL);
-        pthread_create(&tid, NULL, threadWorker, (void *)client_fd);
+        /* tell the old proxy we're accepting; it stops. */
+        write_all(atoi(restart_fd), "r", 1);
+        close(atoi(restart_fd));
     }
+    fflush(stdout);
+
+    /* Until told to stop (or to hand over to a new proxy). */
+    do
+    {
+        sigwait(&stop_signals, &sig);
+    } while (sig == SIGHUP && hot_restart(argv) < 0);
 
-    return 0; // Indicates "no error" (although this is never reached).
+    /* Stop accepting, and let the connections we have finish (for a while). */
+    printf("\e[1m%s: stopping; draining %d connection(s)...\e[0m\n", strsignal(sig), active_connections);
+    stop_accepting();
+    admin_stop();
+    for (i = 0; i < options.acceptors; i++)
+    {
+        close(acceptors[i].listen_fd);
+    }
+    left = drain(options.drain_timeout);
+    if (left > 0)
+        printf("gave up on %d connection(s) after %ds.\n", left, options.drain_timeout);
+    /* (after a hot restart, the new proxy has the cache, and snapshots it from now on.) */
+    if (options.snapshot != NULL && sig != SIGHUP)
+        snapshot();
+    report(0);
+    return 0;
 }
 
 void handle_connection_request(int client_fd)
 {
     int return_cd; // return- (aka. error-) code of function calls.
 
-    /* "Kernel, give me the fd of a connected socket for the next connection request."
-       NOTE: this blocks the proxy until a connection arrives.
+    /* client_fd is a connected socket an accept loop got for a connection request.
        https://man7.org/linux/man-pages/man2/accept.2.html (a system call) */
-    if (error_accept_fatal(client_fd))
-    {
-        exit(1);
-    }
     if (error_accept(client_fd))
     {
         return;
@@ -102,146 +928,814 @@ void handle_connection_request(int client_fd)
     printf("\e[1mfinished processing request.\e[0m\n");
 }
 
-void handle_request(int client_fd)
+/* Send a cached response to the client. If the client asked for a single byte range of a
+   cached 200 response, only that range is sent, as a 206 (or a 416, if it is out of bounds).
+   A compressed response is sent compressed to clients that accept gzip (unless they want a
+   range), and inflated for everyone else.
+   cache may be a copy of the block, made under the read lock (see handle_request): it is sent
+   with no lock held. Returns the number of bytes written, or -1. */
+static ssize_t serve_from_cache(int client_fd, cache_block *cache, strbuf *request_hdr)
 {
-    // server file descriptor
+    char range[MAX_RANGE_FIELD];
+    char if_range[MAX_RANGE_FIELD];
+    char partial_storage[MAX_LINE];
+    strbuf partial;
+    struct iovec iov[2];
+    size_t header_len = cache->header_len, first, last;
+    char *header = cache->response_header; // the response as the origin sent it: header,
+    char *body = cache->body;              // then body (which other blocks may have too)
+    size_t body_len = cache->size - cache->header_len;
+    int satisfiable, wants_range;
+    char *inflated = NULL;
+    ssize_t written = -1;
+
+    /* If-Range asks for the range only if the object hasn't changed; we can't tell, so send it all. */
+    wants_range = get_header_field(request_hdr->data, request_hdr->len, "Range", range, sizeof(range)) == 1 &&
+                  !get_header_field(request_hdr->data, request_hdr->len, "If-Range", if_range, sizeof(if_range));
+
+    if (cache->encoding == CACHE_GZIP)
+    {
+        if (!wants_range && accepts_gzip(request_hdr->data, request_hdr->len))
+        {
+            strbuf_init(&partial, partial_storage, sizeof(partial_storage));
+            if (!set_gzip_response_header(&partial, header, header_len, body_len))
+                return -1;
+            iov[0].iov_base = partial.data;
+            iov[0].iov_len = partial.len;
+            iov[1].iov_base = body;
+            iov[1].iov_len = body_len;
+            return writev_all(client_fd, iov, 2);
+        }
+        if ((inflated = gunzip_response(header, header_len, body, body_len, cache->original_size)) == NULL)
+            return -1;
+        header = inflated;
+        body = inflated + header_len;
+        body_len = cache->original_size - header_len;
+    }
+
+    /* the whole response, unless a range of it is asked for (and can be had). */
+    iov[0].iov_base = header;
+    iov[0].iov_len = header_len;
+    iov[1].iov_base = body;
+    iov[1].iov_len = body_len;
+    if (wants_range && header_len > 0 && response_status(header, header_len) == 200)
+    {
+        strbuf_init(&partial, partial_storage, sizeof(partial_storage));
+        satisfiable = parse_range(range, body_len, &first, &last);
+        if (satisfiable == 1 && set_partial_response_header(&partial, header, header_len, first, last, body_len))
+        {
+            iov[0].iov_base = partial.data;
+            iov[0].iov_len = partial.len;
+            iov[1].iov_base = body + first;
+            iov[1].iov_len = last - first + 1;
+            written = writev_all(client_fd, iov, 2);
+        }
+        else if (satisfiable == 0 && set_unsatisfiable_response(&partial, body_len))
+        {
+            written = write_all(client_fd, partial.data, partial.len);
+        }
+        else
+        {
+            written = writev_all(client_fd, iov, 2);
+        }
+    }
+    else
+    {
+        written = writev_all(client_fd, iov, 2);
+    }
+    free(inflated);
+    return written;
+}
+
+/* Fill in the rest of record, and append it to the access log. */
+static void log_request(access_record *record, struct timeval *arrival, long long start_us, ssize_t bytes, char *request_line)
+{
+    record->timestamp_us = (uint64_t)arrival->tv_sec * 1000000 + arrival->tv_usec;
+    record->thread_id = syscall(SYS_gettid);
+    record->bytes = bytes;
+    record->total_us = now_us() - start_us;
+    access_log(record, request_line);
+}
+
+/* Answer with an error response of the given status, in place of a failing origin's.
+   Returns the number of bytes written, or -1. */
+static ssize_t send_origin_error(int client_fd, int status, int retry_after)
+{
+    char resp_storage[MAX_LINE];
+    strbuf resp;
+    ssize_t num_bytes;
+
+    strbuf_init(&resp, resp_storage, sizeof(resp_storage));
+    if (!set_origin_error_response(&resp, status, retry_after))
+        return -1;
+    num_bytes = write_all(client_fd, resp.data, resp.len);
+    if (error_write_client(client_fd, num_bytes))
+        return -1;
+    return num_bytes;
+}
+
+/* Answer a request the proxy won't forward with an error response of the given status (see
+   set_client_error_response). Returns the number of bytes written, or -1. */
+static ssize_t send_client_error(int client_fd, int status)
+{
+    char resp_storage[MAX_LINE];
+    strbuf resp;
+    ssize_t num_bytes;
+
+    strbuf_init(&resp, resp_storage, sizeof(resp_storage));
+    if (!set_client_error_response(&resp, status))
+        return -1;
+    num_bytes = write_all(client_fd, resp.data, resp.len);
+    if (error_write_client(client_fd, num_bytes))
+        return -1;
+    return num_bytes;
+}
+
+/* Connections not in use (at most CONNECTION_POOL of them), so that a worker needn't allocate one. */
+static connection *pool = NULL;
+static int pooled = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Get a connection (from the pool, if it has one) for client_fd. */
+static connection *conn_get(int client_fd)
+{
+    connection *conn;
+
+    pthread_mutex_lock(&pool_lock);
+    if ((conn = pool) != NULL)
+    {
+        pool = conn->next;
+        pooled--;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (conn == NULL)
+    {
+        if ((conn = malloc(sizeof(connection))) == NULL)
+            return NULL;
+        conn->response = NULL;
+        conn->response_cap = 0;
+    }
+    conn->client_fd = client_fd;
+    return conn;
+}
+
+/* Done with conn: back to the pool (or freed, if the pool is full). A response buffer that
+   grew past RESPONSE_BUFFER is freed either way, so that pooled connections stay small. */
+static void conn_put(connection *conn)
+{
+    if (conn->response_cap > RESPONSE_BUFFER)
+    {
+        free(conn->response);
+        conn->response = NULL;
+        conn->response_cap = 0;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    if (pooled < CONNECTION_POOL)
+    {
+        conn->next = pool;
+        pool = conn;
+        pooled++;
+        conn = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (conn != NULL)
+    {
+        free(conn->response);
+        free(conn);
+    }
+}
+
+/* Make room for size bytes of response in conn (doubling, from RESPONSE_BUFFER), but for no more
+   than limit bytes. Returns 0, or -1 if it can't grow. */
+static int reserve_response(connection *conn, size_t size, size_t limit)
+{
+    size_t cap = conn->response_cap ? conn->response_cap : RESPONSE_BUFFER;
+    char *response;
+
+    while (cap < size)
+        cap *= 2;
+    if (cap > limit)
+        cap = limit;
+    if (cap <= conn->response_cap)
+        return -1;
+    if ((response = realloc(conn->response, cap)) == NULL)
+        return -1;
+    conn->response = response;
+    conn->response_cap = cap;
+    return 0;
+}
+
+/* Open a tunnel to the origin the CONNECT request in conn names (host:port), answer 200,
+   and relay both ways until both sides are done (see tunnel.h). If the origin can't be
+   reached, answer with an error instead, as for a GET.
+   Tunnels go only to the ports in options.connect_ports (-C), and never to this host (see
+   refused): the proxy is not to be a relay into whatever listens on it, or on the ports
+   of other hosts. Other targets are answered 403.
+   The tunnel takes a connection slot only while it connects, and a worker (see clients.h) only
+   until it is open: it lasts as long as the client likes, and it would keep GETs to the same
+   origin, or the connections waiting for a worker, waiting all that time. */
+static void handle_connect(connection *conn, struct timeval *arrival, long long start_us)
+{
+    int client_fd = conn->client_fd;
     int server_fd;
+    char resp_storage[MAX_LINE];
+    strbuf resp;
+    origin *slot;
+    int failure_status, retry_after;
+    tunnel_bytes bytes;
+    access_record record;
+    long long origin_start_us;
+    ssize_t num_bytes;
 
-    /* String variables */
-    char buf[MAX_LINE];
-    char method[MAX_LINE];
-    char uri[MAX_LINE];
-    char version[MAX_LINE];
-    char hostname[MAX_LINE];
-    char path[MAX_LINE];
-    char port[MAX_LINE];
-    char request_hdr_to_server[MAX_LINE];
+    if (!skip_request_header(&conn->request))
+    {
+        return;
+    }
+    if (!parse_connect_target(conn->uri, conn->hostname, conn->port, MAX_HOSTNAME))
+    {
+        fprintf(stderr, "\033[31mfailure:\033[0m bad CONNECT target %s. answering 400.\n", conn->uri);
+        send_client_error(client_fd, 400);
+        return;
+    }
+    if (!port_listed(conn->port, options.connect_ports))
+    {
+        fprintf(stderr, "\033[31mfailure:\033[0m CONNECT to port %s is not allowed (-C). answering 403.\n", conn->port);
+        send_client_error(client_fd, 403);
+        return;
+    }
+
+    failure_status = origin_failing(conn->hostname, conn->port, &retry_after);
+    if (failure_status == 0)
+    {
+        slot = origin_acquire(conn->hostname, conn->port);
+        origin_start_us = now_us();
+        server_fd = create_server_fd(slot->hostname, slot->port, 1);
+        if (server_fd == SERVER_NO_FD)
+        {
+            failure_status = 503;
+            retry_after = 1;
+        }
+        else if (server_fd == SERVER_FORBIDDEN)
+        {
+            failure_status = 403;
+        }
+        else if (error_socket_server(server_fd))
+        {
+            failure_status = server_fd == SERVER_TIMEOUT ? 504 : 502;
+            retry_after = options.negative_ttl;
+            origin_failed(conn->hostname, conn->port, failure_status);
+        }
+        origin_release(slot);
+    }
+    if (failure_status != 0)
+    {
+        if (failure_status == 403)
+            num_bytes = send_client_error(client_fd, 403);
+        else
+            num_bytes = send_origin_error(client_fd, failure_status, retry_after);
+        if (num_bytes >= 0)
+        {
+            record.hit = 0;
+            record.origin_us = 0;
+            log_request(&record, arrival, start_us, num_bytes, conn->request_line);
+        }
+        return;
+    }
+
+    strbuf_init(&resp, resp_storage, sizeof(resp_storage));
+    set_connect_response(&resp);
+    num_bytes = write_all(client_fd, resp.data, resp.len);
+    if (!error_write_client(client_fd, num_bytes))
+    {
+        printf("\033[32msuccess:\033[0m tunnel to %s:%s open.\n", conn->hostname, conn->port);
+        worker_leave();
+        /* (what the client sent right after its request is in the reader already) */
+        tunnel_relay(client_fd, server_fd, conn->request.bf + conn->request.start,
+                     conn->request.end - conn->request.start, &bytes);
+        printf("tunnel to %s:%s closed: %zu bytes up, %zu bytes down.\n", conn->hostname, conn->port,
+               bytes.up, bytes.down);
+
+        record.hit = 0;
+        record.origin_us = now_us() - origin_start_us;
+        log_request(&record, arrival, start_us, num_bytes + bytes.down, conn->request_line);
+    }
+    if (error_close_server(close(server_fd)))
+    { /* ignore */
+    }
+}
+
+void handle_request(int client_fd)
+{
+    static const struct timeval request_timeout = {REQUEST_TIMEOUT, 0};
+    connection *conn;
+    char *authority;
 
     int return_cd;
     ssize_t num_bytes;
 
     // Caching variables
-    char whole_buffer[MAX_OBJECT_SIZE];
-    char request_header_first_line[MAX_LINE];
     cache_block *cache;
+    cache_block hit; // a copy of the one found (see below)
 
-    /* read HTTP Request-line */
-    num_bytes = read_line(client_fd, buf);
-    if (error_read(num_bytes))
+    // Connection slot to the origin
+    origin *slot;
+    int failure_status, retry_after;
+
+    // Access log record for this request (written once the response is sent)
+    access_record record;
+    struct timeval arrival;
+    long long start_us, origin_start_us;
+
+    if ((conn = conn_get(client_fd)) == NULL)
     {
         return;
     }
 
-    // Puts first line into request_header_first_line, used for looking up the cache
-    strcpy(request_header_first_line, buf);
+    /* read HTTP Request-line (through the connection's reader, which takes the rest of the
+       request too, typically in the same `read`). A client that keeps us waiting for its request
+       more than REQUEST_TIMEOUT seconds at a time is dropped: it would hold on to the worker. */
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &request_timeout, sizeof(request_timeout));
+    line_reader_init(&conn->request, client_fd);
+    num_bytes = read_line_buffered(&conn->request, conn->request_line);
+    if (error_read(num_bytes))
+    {
+        goto done;
+    }
+    gettimeofday(&arrival, NULL);
+    start_us = now_us();
+
+    // The request line is also the key for looking up the cache
+    // (read_line_buffered does not null-terminate; see set_request_header for the same edge case at MAX_LINE)
+    conn->request_line[num_bytes < MAX_LINE ? num_bytes : MAX_LINE - 1] = '\0';
 
-    /* print what we just read (it's not null-terminated) */
-    printf("%.*s", (int)num_bytes, buf); // typeast is safe; num_bytes <= MAX_LINE
-    sscanf(buf, "%s %s %s", method, uri, version);
+    /* (the request line is recorded in the access log, once we know how it was served) */
+    conn->method[0] = '\0';
+    sscanf(conn->request_line, "%15s %8191s %15s", conn->method, conn->uri, conn->version);
 
-    /* Ignore non-GET requests (your proxy is only tested on GET requests). */
-    if (error_non_get(method))
+    /* CONNECT host:port asks for a tunnel (e.g. for HTTPS), which we don't look into. */
+    if (strcasecmp(conn->method, "CONNECT") == 0)
     {
-        return;
+        handle_connect(conn, &arrival, start_us);
+        goto done;
     }
 
-    // Check if request is in cache
-    // Adding read lock (allows for multiple readers, and writers must wait)
-    pthread_rwlock_rdlock(&rwlock);
-    cache = find(request_header_first_line);
+    /* Ignore other non-GET requests (your proxy is only tested on GET requests). */
+    if (error_non_get(conn->method))
+    {
+        goto done;
+    }
+
+    /* Parse URI from GET request (hostname and port must fit in theirs; see connection).
+       One we can't forward is answered 400, once the rest of the request is read (see below). */
+    authority = strstr(conn->uri, "//");
+    if (authority == NULL || strcspn(authority + 2, "/") >= MAX_HOSTNAME)
+    {
+        fprintf(stderr, "\033[31mfailure:\033[0m bad request URI %s. answering 400.\n", conn->uri);
+        if (skip_request_header(&conn->request))
+            send_client_error(client_fd, 400);
+        goto done;
+    }
+    parse_uri(conn->uri, conn->hostname, conn->path, conn->port);
+
+    /* Set the request header.
+       NOTE: this reads the rest of the client's request, which we must do even on a cache hit:
+       closing a socket with unread data makes the kernel reset the connection, and the client
+       may lose the response. */
+    strbuf_init(&conn->request_hdr, conn->request_hdr_storage, sizeof(conn->request_hdr_storage));
+    return_cd = set_request_header(&conn->request_hdr, conn->hostname, conn->path, conn->port, &conn->request);
+    if (error_header(return_cd))
+    {
+        if (return_cd < 0)
+            send_client_error(client_fd, 400); // (too big to forward)
+        goto done;
+    }
+
+    // Check if request is in cache: unless the cache's filter says it certainly isn't (no lock needed),
+    // add read lock (allows for multiple readers, and writers must wait)
+    cache = NULL;
+    if (cache_may_have(conn->request_line))
+    {
+        cache_rdlock();
+        cache = find_variant(conn->request_line, conn->request_hdr.data, conn->request_hdr.len);
+        // Request was not in cache, unlock read lock.
+        if (cache == NULL)
+            cache_unlock();
+    }
     if (cache != NULL)
     {
-        num_bytes = write_all(client_fd, cache->content, cache->size);
+        /* Copy it out, and unlock before the client gets it: one that doesn't read it would keep
+           the writers waiting for the lock, and so every reader behind them (in every proxy, with -m). */
+        hit = *cache;
+        if (conn->response_cap < cache->size && reserve_response(conn, cache->size, cache->size) < 0)
+        {
+            cache_unlock();
+            goto done;
+        }
+        memcpy(conn->response, cache->response_header, cache->header_len);
+        memcpy(conn->response + cache->header_len, cache->body, cache->size - cache->header_len);
+        hit.response_header = conn->response;
+        hit.body = conn->response + hit.header_len;
+        cache_unlock();
+
+        num_bytes = serve_from_cache(client_fd, &hit, &conn->request_hdr);
         if (error_write_client(client_fd, num_bytes))
         {
-            return;
+            goto done;
         }
-        // unlock reader lock, so we instead can do a writer lock
-        pthread_rwlock_unlock(&rwlock);
         // Add writer lock, so we can change the cache, by moving this item to the front.
-        pthread_rwlock_wrlock(&rwlock);
-        move_to_head(cache);
+        cache_wrlock();
+        // (Unless it was evicted while no lock was held: look it up again.)
+        cache = find_variant(conn->request_line, conn->request_hdr.data, conn->request_hdr.len);
+        if (cache != NULL)
+            move_to_head(cache);
         // We are done writing, unlock.
-        pthread_rwlock_unlock(&rwlock);
+        cache_unlock();
+
+        record.hit = 1;
+        record.origin_us = 0;
+        log_request(&record, &arrival, start_us, num_bytes, conn->request_line);
+        goto done;
+    }
+
+    /* Wait for a free connection slot to this origin (requests queue up in FIFO order), then fetch.
+       Unless the origin failed a moment ago: then answer right away, without tying up a slot
+       (also if it failed while we were queued for one). */
+    failure_status = origin_failing(conn->hostname, conn->port, &retry_after);
+    if (failure_status == 0)
+    {
+        slot = origin_acquire(conn->hostname, conn->port);
+        failure_status = origin_failing(conn->hostname, conn->port, &retry_after);
+        origin_start_us = now_us();
+        if (failure_status == 0)
+            num_bytes = fetch_from_server(conn, slot); // (releases slot)
+        else
+            origin_release(slot);
+    }
+    if (failure_status != 0)
+    {
+        num_bytes = send_origin_error(client_fd, failure_status, retry_after);
+        origin_start_us = now_us();
+    }
+
+    if (num_bytes >= 0)
+    {
+        record.hit = 0;
+        record.origin_us = now_us() - origin_start_us;
+        log_request(&record, &arrival, start_us, num_bytes, conn->request_line);
+    }
+
+done:
+    conn_put(conn);
+}
+
+/* Cache the response in conn->response (size bytes; the whole of it), if it may be cached. */
+static void cache_response(connection *conn, size_t size)
+{
+    char *whole_buffer = conn->response;
+    char vary[MAX_VARY_FIELD];
+    char coding[64];
+    char variant_key_storage[MAX_LINE];
+    strbuf variant_key;
+    size_t header_len;
+    char *compressed = NULL;
+    char *framed = NULL;
+    char length_header_storage[MAX_LINE];
+    strbuf length_header;
+    char *stored;
+    size_t stored_size;
+    uint64_t body_hash;
+    int encoding;
+    int status;
+    int varies;
+
+    //  Not if it is only part of the object: a 206, for a client's Range request.
+    //  (Ranges of cached objects are served from the whole object; see serve_from_cache)
+    //  Nor a 5xx: the origin is in trouble, so instead remember it is failing, for a while.
+    status = response_status(whole_buffer, size);
+    if (status >= 500)
+    {
+        origin_failed(conn->hostname, conn->port, status);
+        return;
+    }
+    if (status == 206)
+    {
         return;
     }
-    // Request was not in cache, unlock read lock.
-    pthread_rwlock_unlock(&rwlock);
 
-    /* Parse URI from GET request */
-    parse_uri(uri, hostname, path, port);
+    // A response with a Vary field is only valid for requests that agree on the fields it names;
+    // cache it as a variant, keyed by the values our request had for them. (`Vary: *`: never valid;
+    // nor a Vary too long for vary: a key from part of its names would be shared by other variants.)
+    header_len = response_header_length(whole_buffer, size);
+    strbuf_init(&variant_key, variant_key_storage, sizeof(variant_key_storage));
+    if (header_len == 0 ||
+        (varies = get_header_field(whole_buffer, header_len, "Vary", vary, sizeof(vary))) < 0 ||
+        (varies &&
+         (!strcmp(vary, "*") ||
+          !set_variant_key(&variant_key, vary, conn->request_hdr.data, conn->request_hdr.len))))
+    {
+        return; // not cacheable.
+    }
 
-    /* Set the request header */
-    return_cd = set_request_header(request_hdr_to_server, hostname, path, port, client_fd);
-    if (error_header(return_cd))
+    // A chunked body was decoded as it arrived (see take_response): it's stored with its length,
+    // if it came whole. One still framed (its header got to the client before it was complete,
+    // or it has other transfer codings too) is not cached: we can't tell it came whole, and
+    // ranges or gzip would be cut from its framing.
+    if (!conn->chunked && get_header_field(whole_buffer, header_len, "Transfer-Encoding", coding, sizeof(coding)) != 0)
     {
         return;
     }
+    if (conn->chunked)
+    {
+        strbuf_init(&length_header, length_header_storage, sizeof(length_header_storage));
+        if (!chunk_done(&conn->dechunk) ||
+            !set_unframed_response_header(&length_header, whole_buffer, header_len, size - header_len) ||
+            (framed = malloc(length_header.len + size - header_len)) == NULL)
+        {
+            return;
+        }
+        memcpy(framed, length_header.data, length_header.len);
+        memcpy(framed + length_header.len, whole_buffer + header_len, size - header_len);
+        size = length_header.len + size - header_len;
+        header_len = length_header.len;
+        whole_buffer = framed;
+    }
+
+    // With -z, text is stored gzip'ed (compressing before taking the lock), so more of it fits.
+    // The body is keyed by its hash (see insert_variant): hashed as it arrived, unless it's compressed now.
+    stored = whole_buffer;
+    stored_size = size;
+    encoding = CACHE_IDENTITY;
+    body_hash = xxh64_digest(&conn->body_hash);
+    if (options.compress && is_compressible(whole_buffer, header_len))
+    {
+        stored_size = gzip_response(whole_buffer, header_len, size, &compressed);
+        if (stored_size > 0)
+        {
+            stored = compressed;
+            encoding = CACHE_GZIP;
+            body_hash = xxh64(compressed + header_len, stored_size - header_len);
+        }
+        else
+        {
+            stored_size = size;
+        }
+    }
+
+    // write cache, add a w lock
+    cache_wrlock();
+    // write content to cache
+    insert_variant(conn->request_line, variant_key.len > 0 ? vary : NULL,
+                   variant_key.len > 0 ? variant_key.data : NULL,
+                   stored, stored_size, size, encoding, body_hash);
+    // unlock
+    cache_unlock();
+    free(compressed);
+    free(framed);
+}
+
+/* Take in the num_bytes just read into conn->response at filled (while hashing, it is all of the
+   response so far). Once the header is complete: if the body is chunked, and none of the response
+   has gone to the client yet (unsent), the header loses its framing fields and the body is decoded in
+   place from then on, so that the client and the cache get the bare body (ending when the connection
+   does); and while hashing, the body is hashed as it arrives (see cache_response).
+   (A header that got to the client before it was complete, being longer than MAX_LINE or -b, is
+   relayed as it is, body and all.)
+   Returns where the bytes kept now end in conn->response: filled + num_bytes, less the framing taken
+   out (which may be more than was read, when the header shrinks), or -1 if the chunked framing is broken. */
+static ssize_t take_response(connection *conn, size_t filled, size_t num_bytes, int hashing, int unsent)
+{
+    char *data = conn->response;
+    size_t from = filled, to = filled + num_bytes;
+    size_t header_len;
+    char header_storage[MAX_LINE];
+    strbuf header;
+    ssize_t n;
+
+    if (conn->body_start == 0)
+    {
+        if (!hashing || (header_len = response_header_length(data, to)) == 0)
+            return to; // the header isn't all here yet.
+        conn->body_start = header_len;
+        strbuf_init(&header, header_storage, sizeof(header_storage));
+        if (unsent && is_chunked(data, header_len) && set_unframed_response_header(&header, data, header_len, -1))
+        {
+            memcpy(data, header.data, header.len); // (it's shorter)
+            memmove(data + header.len, data + header_len, to - header_len);
+            to -= header_len - header.len;
+            conn->body_start = header.len;
+            conn->chunked = 1;
+            chunk_decoder_init(&conn->dechunk);
+        }
+        from = conn->body_start;
+    }
+    if (conn->chunked)
+    {
+        if ((n = chunk_decode(&conn->dechunk, data + from, to - from)) < 0)
+            return -1;
+        to = from + n;
+    }
+    if (hashing)
+        xxh64_update(&conn->body_hash, data + from, to - from);
+    return to;
+}
 
-    /* Create the server fd. */
-    server_fd = create_server_fd(hostname, port);
+/* Forward the request to the origin, and relay its response back to the client (caching it if it fits).
+   The origin is read as fast as it sends, into conn->response, and the client is sent what is
+   in there as fast as it takes it; the two only wait for each other when the client is
+   options.relay_buffer bytes behind. So a slow client doesn't hold up the origin connection:
+   once the origin is done, it is closed and slot released (this function releases it), and
+   the client gets the rest from the buffer.
+   Returns the number of bytes relayed, or -1 if the request had to be dropped. */
+ssize_t fetch_from_server(connection *conn, origin *slot)
+{
+    // server file descriptor
+    int server_fd;
+    int client_fd = conn->client_fd;
+
+    int return_cd;
+    ssize_t num_bytes;
+
+    /* The buffer holds bytes [base, base + filled) of the response, of which the first `sent`
+       have gone to the client. While fits, base is 0 (it's the whole response, for the cache).
+       It grows to MAX_OBJECT_SIZE, or to options.relay_buffer if that is more. */
+    size_t base = 0, filled = 0, sent = 0;
+    size_t room;
+    size_t limit = options.relay_buffer > MAX_OBJECT_SIZE ? options.relay_buffer : MAX_OBJECT_SIZE;
+    int fits = 1;
+    int eof = 0;
+    struct pollfd ready[2];
+
+    /* Create the server fd. If that fails, tell the client (and remember it, for the next ones). */
+    server_fd = create_server_fd(slot->hostname, slot->port, 0);
+    if (server_fd == SERVER_NO_FD)
+    {
+        origin_release(slot);
+        return send_origin_error(client_fd, 503, 1);
+    }
+    if (server_fd == SERVER_FORBIDDEN)
+    {
+        origin_release(slot);
+        return send_client_error(client_fd, 403);
+    }
     if (error_socket_server(server_fd))
     {
-        return;
+        return_cd = server_fd == SERVER_TIMEOUT ? 504 : 502;
+        origin_failed(conn->hostname, conn->port, return_cd);
+        origin_release(slot);
+        return send_origin_error(client_fd, return_cd, options.negative_ttl);
     }
 
-    /* Write the request (header) to the server. */
-    return_cd = write_all(server_fd, request_hdr_to_server, strlen(request_hdr_to_server));
+    /* Write the request (header) to the server; it is one contiguous buffer of known length. */
+    return_cd = write_all(server_fd, conn->request_hdr.data, conn->request_hdr.len);
     if (error_write_server(server_fd, return_cd))
     {
-        return;
+        origin_release(slot);
+        return -1;
     }
 
     /* Transfer the response from the server, to the client.
-       (until server responds with EOF). */
-    int totalSize = 0;
-    do
+       (until server responds with EOF, or the last chunk). The client's socket doesn't block meanwhile. */
+    conn->body_start = 0;
+    conn->chunked = 0;
+    xxh64_init(&conn->body_hash);
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+    while (server_fd >= 0)
     {
-        // Num of bytes in buffer this iteration
-        num_bytes = read(server_fd, buf, MAX_LINE);
-        totalSize += num_bytes;
-        if (error_read_server(server_fd, num_bytes))
+        /* Room for more? Grow the buffer; and once the response is too big for the cache,
+           keep only the bytes the client hasn't got yet. */
+        if (conn->response_cap - filled < MAX_LINE)
         {
-            return;
+            reserve_response(conn, filled + MAX_LINE, limit);
         }
-        // Take the part of the page (buf) and concat it our whole_buffer which is the whole page, but only if it fits the max object size restriction
-        if (totalSize < MAX_OBJECT_SIZE)
+        fits = fits && filled < MAX_OBJECT_SIZE;
+        if (!fits && sent > 0 && conn->response_cap - filled < MAX_LINE)
         {
-            strncat(whole_buffer, buf, num_bytes);
+            memmove(conn->response, conn->response + sent, filled - sent);
+            base += sent;
+            filled -= sent;
+            sent = 0;
         }
-        // Write = write
-        num_bytes = write_all(client_fd, buf, num_bytes);
-        if (error_write_client(client_fd, num_bytes))
+        room = conn->response_cap - filled;
+        if (filled - sent + room > (size_t)options.relay_buffer)
+            room = filled - sent < (size_t)options.relay_buffer ? options.relay_buffer - (filled - sent) : 0;
+
+        if (room == 0 && sent == filled)
         {
-            return;
+            fprintf(stderr, "\033[31mfailure:\033[0m no memory for the response. dropping request.\n");
+            break; // no buffer to read into.
+        }
+
+        /* (a negative fd is left out: we don't want it woken up for hangups we can't act on yet.
+           the client gets nothing of a header until it is complete, as it may be rewritten; see take_response) */
+        ready[0].fd = room > 0 ? server_fd : -1;
+        ready[0].events = POLLIN;
+        ready[1].fd = sent < filled && (conn->body_start > 0 || filled >= MAX_LINE || room == 0) ? client_fd : -1;
+        ready[1].events = POLLOUT;
+        if (poll(ready, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "\033[31mfailure:\033[0m poll (%s). dropping request.\n", strerror(errno));
+            break;
         }
-    } while (num_bytes > 0);
 
-    // debugging
-    // printf("\n There should only be 1 print:\n");
-    // printf("\n request_header_first_line print here:\n %s", request_header_first_line);
-    // printf("\n buf print here:\n %s", buf);
-    // printf("\n whole_buffer print here:\n %s", whole_buffer);
+        if (ready[0].revents)
+        {
+            // Num of bytes read this iteration, straight to the end of the buffer
+            num_bytes = read(server_fd, conn->response + filled, room);
+            if (error_read_server(server_fd, num_bytes))
+            {
+                origin_release(slot);
+                return -1;
+            }
+            if (num_bytes > 0)
+            {
+                num_bytes = take_response(conn, filled, num_bytes, base == 0, sent == 0); // (hashed while it may be cached)
+                if (num_bytes < 0)
+                {
+                    fprintf(stderr, "\033[31mfailure:\033[0m broken chunked response. dropping request.\n");
+                    close(server_fd);
+                    origin_release(slot);
+                    return -1;
+                }
+                filled = num_bytes;
+            }
+            else
+            {
+                eof = 1;
+            }
+            if (eof || (conn->chunked && chunk_done(&conn->dechunk)))
+            {
+                /* the origin is done (it may keep the connection open past the last chunk, but that's all):
+                   let the next request have the connection slot right away. */
+                return_cd = close(server_fd);
+                if (error_close_server(return_cd))
+                { /* ignore */
+                }
+                server_fd = -1;
+                origin_release(slot);
+            }
+        }
+
+        if (ready[1].revents)
+        {
+            num_bytes = write(client_fd, conn->response + sent, filled - sent);
+            if (num_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                continue;
+            if (error_write_client(client_fd, num_bytes))
+            {
+                if (server_fd >= 0)
+                {
+                    close(server_fd);
+                    origin_release(slot);
+                }
+                return -1;
+            }
+            sent += num_bytes;
+        }
+    }
+
+    /* Gave up on it midway (see above): the client is told, with a 502 if it has none of the
+       response yet; otherwise its connection is reset, so that it can't take what it got
+       (if the response ends where the connection does) for all of it. */
+    if (server_fd >= 0)
+    {
+        close(server_fd);
+        origin_release(slot);
+        fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) & ~O_NONBLOCK);
+        if (base + sent == 0)
+            send_origin_error(client_fd, 502, 0);
+        else
+            setsockopt(client_fd, SOL_SOCKET, SO_LINGER, &(struct linger){1, 0}, sizeof(struct linger));
+        return -1;
+    }
 
-    //  If we can fit our page into our buffer
-    if (totalSize < MAX_OBJECT_SIZE)
+    /* Nothing at all: the origin hung up on us. Tell the client so (and remember it, for the next ones). */
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) & ~O_NONBLOCK);
+    if (base + filled == 0)
     {
-        // write cache, add a w lock
-        pthread_rwlock_wrlock(&rwlock);
-        // write content to cache
-        insert_head(request_header_first_line, whole_buffer, totalSize);
-        // unlock
-        pthread_rwlock_unlock(&rwlock);
+        origin_failed(conn->hostname, conn->port, 502);
+        return send_origin_error(client_fd, 502, options.negative_ttl);
     }
 
-    /* success; close the file descrpitor. */
-    return_cd = close(server_fd);
-    if (error_close_server(return_cd))
-    { /* ignore */
+    /* Cache it, if it fit (before the client has it all: the next request for it needn't wait),
+       then send the client the rest. */
+    if (fits && base + filled < MAX_OBJECT_SIZE)
+    {
+        cache_response(conn, filled);
+    }
+    num_bytes = write_all(client_fd, conn->response + sent, filled - sent);
+    if (error_write_client(client_fd, num_bytes))
+    {
+        return -1;
     }
+    return base + filled;
 }
 
-int create_listen_fd(int port)
+int create_listen_fd(int port, int reuse_port)
 {
     /* File descriptors */
     int listen_fd; // fd for connection requests from clients.
@@ -260,7 +1754,7 @@ int create_listen_fd(int port)
 
     /* "Kernel, make me a socket." (for listening to client connection requests).
        https://man7.org/linux/man-pages/man2/socket.2.html (a system call) */
-    listen_fd = socket(listen_addr.sin_family, SOCK_STREAM, 0);
+    listen_fd = socket(listen_addr.sin_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (error_socket_fatal(listen_fd))
     {
         exit(1);
@@ -276,6 +1770,17 @@ int create_listen_fd(int port)
     { /* ignore */
     }
 
+    /* "Kernel, let other sockets bind to this very port too." (only with several acceptors)
+       NOTE: the kernel then load-balances connection requests across all of them.
+       https://man7.org/linux/man-pages/man7/socket.7.html */
+    if (reuse_port)
+    {
+        return_cd = setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int));
+        if (error_socket_option(return_cd))
+        { /* ignore */
+        }
+    }
+
     /* "Kernel, bind it to this socket address" (i.e. where proxy shall listen).
        https://man7.org/linux/man-pages/man2/bind.2.html (a system call) */
     return_cd = bind(listen_fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr));
@@ -317,55 +1822,225 @@ void set_listen_socket_address(struct sockaddr_in *listen_addr, int port)
     printf("\033[32msuccess:\033[0m set socket address of proxy.\n");
 }
 
-int create_server_fd(char *hostname, char *port)
+/* Order candidates the way RFC 8305 ("Happy Eyeballs") suggests: alternate address
+   families, starting with the family getaddrinfo preferred. Returns the number of candidates. */
+static int order_candidates(struct addrinfo *cand_ai, struct addrinfo **ordered, int max)
 {
-    int server_fd;
+    struct addrinfo *curr_ai;
+    struct addrinfo *first[MAX_CANDIDATES], *other[MAX_CANDIDATES];
+    int n_first = 0, n_other = 0, n = 0, i = 0, j = 0;
+
+    for (curr_ai = cand_ai; curr_ai != NULL; curr_ai = curr_ai->ai_next)
+    {
+        if (curr_ai->ai_family == cand_ai->ai_family && n_first < MAX_CANDIDATES)
+            first[n_first++] = curr_ai;
+        else if (curr_ai->ai_family != cand_ai->ai_family && n_other < MAX_CANDIDATES)
+            other[n_other++] = curr_ai;
+    }
+    while (n < max && (i < n_first || j < n_other))
+    {
+        if (i < n_first)
+            ordered[n++] = first[i++];
+        if (n < max && j < n_other)
+            ordered[n++] = other[j++];
+    }
+    return n;
+}
+
+/* Is sa an address of this host: loopback (127.0.0.0/8, ::1, or ::ffff:127.x.x.x), or
+   unspecified (0.0.0.0, ::; connecting to it reaches this host too)? */
+static int is_local_address(struct sockaddr *sa)
+{
+    struct in6_addr *a6;
+    uint32_t a4;
+
+    if (sa->sa_family == AF_INET)
+    {
+        a4 = ntohl(((struct sockaddr_in *)sa)->sin_addr.s_addr);
+        return (a4 >> 24) == 127 || a4 == 0;
+    }
+    if (sa->sa_family == AF_INET6)
+    {
+        a6 = &((struct sockaddr_in6 *)sa)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(a6))
+            return a6->s6_addr[12] == 127 || !memcmp(&a6->s6_addr[12], "\0\0\0\0", 4);
+        return IN6_IS_ADDR_LOOPBACK(a6) || IN6_IS_ADDR_UNSPECIFIED(a6);
+    }
+    return 0;
+}
+
+/* May the proxy not connect to ai? A tunnel (CONNECT) never goes to this host, and no request
+   goes to the admin port on it: that it listens on 127.0.0.1 only keeps out other hosts, but
+   not requests they send through the proxy. */
+static int refused(struct addrinfo *ai, int tunnel)
+{
+    in_port_t port;
+
+    if (!is_local_address(ai->ai_addr))
+        return 0;
+    if (tunnel)
+        return 1;
+    port = ai->ai_family == AF_INET6 ? ((struct sockaddr_in6 *)ai->ai_addr)->sin6_port
+                                     : ((struct sockaddr_in *)ai->ai_addr)->sin_port;
+    return options.admin_port > 0 && ntohs(port) == options.admin_port;
+}
+
+/* Start a non-blocking connect to ai. Returns the socket (connected, or with the
+   connect in progress), or -1 if the attempt failed right away. */
+static int start_connect(struct addrinfo *ai, int *connected)
+{
+    int fd;
+
+    /* "Kernel, make me a socket." (for ai; one that won't block on connect)
+       https://man7.org/linux/man-pages/man2/socket.2.html (a system call) */
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd == -1)
+        return -1;
+
+    /* "Kernel, please (attempt to) connect to said socket. Don't wait for it."
+       https://man7.org/linux/man-pages/man2/connect.2.html (a system call) */
+    *connected = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+    if (*connected || errno == EINPROGRESS)
+        return fd;
+
+    close(fd);
+    return -1;
+}
+
+/* Connect to hostname:port (for a tunnel, if tunnel). Candidate addresses are raced: a new
+   attempt starts every CONNECT_ATTEMPT_DELAY ms (or as soon as the previous one fails), while
+   earlier attempts keep going; the first to complete wins. Gives up after options.connect_timeout ms.
+   Addresses the proxy may not connect to (see refused) are left out; SERVER_FORBIDDEN if all are. */
+int create_server_fd(char *hostname, char *port, int tunnel)
+{
+    int server_fd = -1;
     int return_cd;
 
     struct addrinfo *cand_ai; // pointer to heap-allocated candidate server addresses (free this!)
+    struct addrinfo *ordered[MAX_CANDIDATES];
+    int n_cand, next = 0;
 
-    /* Get list of candidate server socket addresses. */
+    struct pollfd attempts[MAX_CANDIDATES]; // connects in flight
+    int n_attempts = 0;
+    int i, connected, err, no_fd = 0;
+    socklen_t err_len;
+    long long now, deadline, next_start, wait;
+
+    /* Get list of candidate server socket addresses. (That takes a socket, or memory, too: if we
+       are out of those, the name may be fine.) */
+    errno = 0;
     return_cd = get_server_socket_address_candidates(&cand_ai, hostname, port);
+    err = errno;
     if (error_address_server(return_cd))
     {
-        return -1;
+        if (return_cd == EAI_MEMORY || err == EMFILE || err == ENFILE)
+            return SERVER_NO_FD;
+        return SERVER_UNREACHABLE;
+    }
+    n_cand = order_candidates(cand_ai, ordered, MAX_CANDIDATES);
+    for (i = next = 0; i < n_cand; i++)
+        if (!refused(ordered[i], tunnel))
+            ordered[next++] = ordered[i];
+    if (next == 0 && n_cand > 0)
+    {
+        fprintf(stderr, "\033[31mfailure:\033[0m %s:%s is not to be connected to. refusing.\n", hostname, port);
+        freeaddrinfo(cand_ai);
+        return SERVER_FORBIDDEN;
     }
+    n_cand = next;
+    next = 0;
 
-    struct addrinfo *curr_ai; // pointer to current candidate server address in the above list.
+    now = now_ms();
+    deadline = now + options.connect_timeout;
+    next_start = now;
 
-    /* produces a socket (server_fd) bound to the first candidate address (in cand_ai)
-       for which creating (resp. binding) a socket for (resp. to) it was successful. */
-    for (curr_ai = cand_ai; curr_ai != NULL; curr_ai = curr_ai->ai_next)
+    while (server_fd < 0)
     {
-        /* "Kernel, make me a socket." (for curr_ai)
-           https://man7.org/linux/man-pages/man2/socket.2.html (a system call) */
-        server_fd = socket(curr_ai->ai_family, curr_ai->ai_socktype, curr_ai->ai_protocol);
-        if (server_fd == -1)
-            continue; // try the next ai.
+        /* Time to start the next attempt? */
+        if (next < n_cand && now >= next_start)
+        {
+            int fd = start_connect(ordered[next++], &connected);
+            if (fd >= 0 && connected)
+            {
+                server_fd = fd;
+                break;
+            }
+            if (fd >= 0)
+            {
+                attempts[n_attempts].fd = fd;
+                attempts[n_attempts].events = POLLOUT;
+                n_attempts++;
+                next_start = now + CONNECT_ATTEMPT_DELAY;
+            }
+            else if (errno == EMFILE || errno == ENFILE)
+            {
+                /* our shortage, not the origin's fault: the other candidates won't do better,
+                   but the attempts already going may yet connect. */
+                printf("failure connecting to socket. out of file descriptors.\n");
+                no_fd = 1;
+                next = n_cand;
+            }
+            else
+            {
+                printf("failure connecting to socket. trying next one.\n");
+                next_start = now; // don't make the next candidate wait for a dead one.
+            }
+            continue;
+        }
 
-        /* "Kernel, please (attempt to) connect to said socket."
-           https://man7.org/linux/man-pages/man2/connect.2.html (a system call) */
-        return_cd = connect(server_fd, curr_ai->ai_addr, curr_ai->ai_addrlen);
-        // return_cd = connect ( server_fd, (struct sockaddr *)&curr_ai, sizeof(curr_ai) );
-        if (return_cd < 0)
+        if (n_attempts == 0 && next >= n_cand)
+            break; // all candidates failed.
+        if (now >= deadline)
         {
+            printf("failure connecting to socket. timed out after %dms.\n", options.connect_timeout);
+            break;
+        }
+
+        /* Wait for an attempt to complete, the next attempt to be due, or the deadline. */
+        wait = deadline - now;
+        if (next < n_cand && next_start - now < wait)
+            wait = next_start - now;
+        poll(attempts, n_attempts, (int)wait);
+        now = now_ms();
+
+        for (i = 0; i < n_attempts; i++)
+        {
+            if (attempts[i].revents == 0)
+                continue;
+            /* it completed; did it succeed? */
+            err_len = sizeof(err);
+            if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 && err == 0)
+            {
+                server_fd = attempts[i].fd;
+                attempts[i] = attempts[--n_attempts];
+                break;
+            }
             printf("failure connecting to socket. trying next one.\n");
+            close(attempts[i].fd);
+            attempts[i--] = attempts[--n_attempts];
+            next_start = now;
         }
-        if (return_cd == 0)
-            break; // success
+    }
 
-        /* couldn't bind the socket to curr_ai. try the next ai. */
-        close(server_fd);
+    /* Abandon the attempts that lost the race. */
+    for (i = 0; i < n_attempts; i++)
+    {
+        close(attempts[i].fd);
     }
     /* free up the heap-allocated linked list. */
-    freeaddrinfo(curr_ai);
+    freeaddrinfo(cand_ai);
 
     /* report errors if any. */
-    if (return_cd < 0)
+    if (server_fd < 0)
     {
-        return -1;
+        if (no_fd)
+            return SERVER_NO_FD;
+        return now >= deadline ? SERVER_TIMEOUT : SERVER_UNREACHABLE;
     }
 
+    /* the rest of the proxy does blocking I/O on the socket. */
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) & ~O_NONBLOCK);
+
     /* success; return the server fd. */
     return server_fd;
 }
@@ -2,15 +2,93 @@
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 #define LISTENQ 1024
+#define STATS_INTERVAL 10 // seconds between metric reports (0 disables them)
+#define CONNECT_TIMEOUT 5000      // ms before giving up on connecting to an origin
+#define CONNECT_ATTEMPT_DELAY 250 // ms between starting connects to successive addresses (RFC 8305)
+#define MAX_CANDIDATES 16         // addresses of an origin that we try at most
+#define MAX_RANGE_FIELD 256       // longest Range (or If-Range) field value we look at
+#define MAX_VARY_FIELD 512        // longest Vary field value we cache variants for (a longer one: not cached)
+#define MAX_ACCEPTORS 64          // listening sockets (each with its own accept loop) at most
+#define ACCEPT_BACKOFF_MIN 1      // ms an accept loop pauses after running out of file descriptors (or memory) ...
+#define ACCEPT_BACKOFF_MAX 1000   // ... doubling, while it keeps running out, up to this
+#define MAX_HOSTNAME 256          // longest host:port in a request URI we accept (DNS names are <= 253)
+#define WORKER_STACK_SIZE (64 * 1024) // each worker thread's stack; connection state lives in its connection
+#define CONNECTION_POOL 256       // unused connections kept for reuse at most
+#define RESPONSE_BUFFER 16384     // initial size of a connection's response buffer (it grows to MAX_OBJECT_SIZE)
+#define RELAY_BUFFER MAX_OBJECT_SIZE // bytes of response a connection buffers for a slow client, at most
+#define SNAPSHOT_INTERVAL 300     // seconds between cache snapshots (with -s)
+#define DRAIN_TIMEOUT 30          // seconds to let active connections finish, when stopping
+#define MAX_WORKERS 1024          // connections handled at once (each by a worker thread); the rest wait their turn
+#define REQUEST_TIMEOUT 10        // seconds a client may keep us waiting for (more of) its request header
+#define RESTART_FD_ENV "PROXY_RESTART_FD" // set in a hot-restarted proxy: fd to take over the listening sockets from
+#define SERVER_UNREACHABLE -1     // create_server_fd: the origin's name didn't resolve, or it refused us
+#define SERVER_TIMEOUT -2         // create_server_fd: no address accepted the connection in time
+#define SERVER_NO_FD -3           // create_server_fd: we are out of file descriptors, or memory (not the origin's fault)
+#define SERVER_FORBIDDEN -4       // create_server_fd: the origin is on this host, where it may not go (see refused)
+#define CONNECT_PORTS "443"       // ports CONNECT may open a tunnel to, by default
 
-#ifndef MAX_LINE
-#define MAX_LINE 8192 // HTTP Semantics (RFC 9110) recommends >= 8000 characters.
-#endif/*MAX_LINE*/
+#include "io.h" // MAX_LINE, line_reader
+#include "strbuf.h"
+#include "http.h" // chunk_decoder
+#include "xxhash.h"
+
+typedef struct proxy_options
+{
+    int max_per_origin;  // -c: connections open to one (host, port) at a time
+    int stats_interval;  // -i: seconds between metric reports
+    int connect_timeout; // -t: ms before giving up on connecting to an origin
+    int acceptors;       // -a: listening sockets, each with its own accept loop
+    char *access_log;    // -l: file to append the binary access log to (NULL: no log)
+    int compress;        // -z: store cacheable text responses gzip'ed
+    int negative_ttl;    // -e: seconds an origin failure is remembered (0: not at all)
+    int drain_timeout;   // -d: seconds active connections get to finish, when stopping
+    char *shared_cache;  // -m: name of the shared-memory segment the cache is in (NULL: a cache of its own)
+    char *snapshot;      // -s: file the cache is restored from, and snapshot to (NULL: none)
+    int snapshot_interval; // -S: seconds between snapshots (0: only when stopping)
+    int relay_buffer;    // -b: bytes of response buffered for a client that reads slower than the origin sends
+    int uring;           // -U: accept connections through io_uring (multishot accept)
+    int admin_port;      // -A: port (on 127.0.0.1) for admin requests; see admin.h (0: none)
+    double client_rate;  // -r: connections a client (IP address) may open per second (0: any number)
+    double client_burst; // -r .../B: ... at once (default: client_rate)
+    int max_workers;     // -w: connections handled at once (0: no limit); see clients.h
+    int numa_node;       // -N: NUMA node the cache's memory and the acceptors (and so the workers) are on (-1: any)
+    char *connect_ports; // -C: comma-separated ports CONNECT may open a tunnel to
+} proxy_options;
+
+extern proxy_options options;
+
+struct origin; // origin.h
+
+/* Everything a worker keeps while it handles one connection, off its (small) stack.
+   Taken from a pool of unused ones, and put back after (see conn_get, conn_put). */
+typedef struct connection
+{
+    int client_fd;
+    char method[16];
+    char version[16];
+    char hostname[MAX_HOSTNAME];
+    char port[MAX_HOSTNAME];
+    strbuf request_hdr;         // the header we send to the origin (in request_hdr_storage)
+    char *response;             // the origin's response, as far as it fits (NULL until there is one)
+    size_t response_cap;        // bytes allocated for response
+    size_t body_start;          // where the response's body starts (0 until its header is complete)
+    int chunked;                // 1: the origin sends the body chunked; it is decoded as it arrives
+    chunk_decoder dechunk;      // (if chunked)
+    xxh64_state body_hash;      // of the body, as it arrives (see take_response)
+    struct connection *next;    // next unused connection in the pool
+
+    line_reader request;         // the client's request, as read so far
+    char request_line[MAX_LINE]; // (NUL-terminated) also the cache key
+    char uri[MAX_LINE];
+    char path[MAX_LINE];
+    char request_hdr_storage[MAX_LINE];
+} connection;
 
 void handle_request ( int fd );
-int  create_listen_fd ( int port);
+ssize_t fetch_from_server ( connection *conn, struct origin *slot );
+int  create_listen_fd ( int port, int reuse_port );
 void handle_connection_request ( int listen_fd );
 void get_client_socket_address ( struct sockaddr *client_addr, char *hostname, char *port);
 void set_listen_socket_address ( struct sockaddr_in *listen_addr, int port );
 int  get_server_socket_address_candidates ( struct addrinfo **cand_ai, char* hostname, char* port );
-int  create_server_fd ( char* hostname, char* port );
+int  create_server_fd ( char* hostname, char* port, int tunnel );
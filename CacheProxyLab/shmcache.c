@@ -0,0 +1,529 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+#include "shmcache.h"
+#include "arena.h"
+#include "bloom.h"
+#include "http.h"
+
+#define NIL ARENA_NIL // "no entry" (offsets are into the arena, which is much smaller)
+
+// A cached response in the arena: this header, then the request line, vary and variant key
+// (each with a '\0' after it; vary_len 0: no Vary), then the content.
+typedef struct shm_entry
+{
+    uint32_t prev;          // LRU list: the next more recently used entry (NIL: this is the most recent)
+    uint32_t next;          // the next less recently used entry (NIL: this is the least recent)
+    uint32_t chain;         // next entry in the same hash bucket
+    uint32_t size;          // bytes of content
+    uint32_t original_size; // see cache_block
+    uint32_t hits;          // see cache_block
+    uint16_t header_len;
+    uint16_t vary_len;
+    uint16_t key_len;
+    uint8_t encoding;
+    char data[];
+} shm_entry;
+
+// A process using the segment, as the lock (see shmcache.h) knows it.
+typedef struct shm_holder
+{
+    int32_t pid;     // (0: slot unused)
+    int32_t readers; // its threads holding the lock for reading
+    int32_t waiting; // its threads waiting to hold it for writing
+} shm_holder;
+
+typedef struct shm_lock
+{
+    pthread_mutex_t mutex;    // (robust, process-shared) guards the rest
+    pthread_cond_t released;  // (process-shared) broadcast when the writer, or the last reader, lets go
+    int32_t writer;           // the process whose thread holds it for writing (0: none)
+    shm_holder holders[SHM_LOCK_HOLDERS];
+} shm_lock;
+
+// The segment: the arena (at offset 0, so that it is aligned to a huge page in the file as in
+// the mapping), then this header.
+typedef struct shm_header
+{
+    char magic[8];            // SHM_CACHE_MAGIC, once the creator has set everything else up
+    uint64_t segment_size;
+    shm_lock lock;
+    uint32_t lru_head;        // most recently used entry
+    uint32_t lru_tail;        // least recently used entry
+    uint64_t entries;
+    uint64_t stored;          // bytes of content (at most MAX_CACHE_SIZE, as in the private cache)
+    uint64_t original_bytes;
+    uint32_t buckets[SHM_BUCKETS];
+    uint8_t filter[BLOOM_COUNTERS]; // the request lines of the entries (see bloom.h)
+    arena_chunks chunks;      // the arena's chunks
+} shm_header;
+
+#define SEGMENT_SIZE (ARENA_SIZE + sizeof(shm_header))
+
+static shm_header *shm;
+static char *arena;
+static int32_t own_pid;
+static shm_holder *own; // this process' slot in shm->lock.holders
+
+#define ENTRY(off) ((shm_entry *)(arena + (off)))
+
+// 32-bit FNV-1a of the request line: picks its hash bucket.
+static uint32_t hash(char *s)
+{
+    uint32_t h = 2166136261u;
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static void lru_unlink(uint32_t off)
+{
+    shm_entry *e = ENTRY(off);
+
+    if (e->prev != NIL)
+        ENTRY(e->prev)->next = e->next;
+    else
+        shm->lru_head = e->next;
+    if (e->next != NIL)
+        ENTRY(e->next)->prev = e->prev;
+    else
+        shm->lru_tail = e->prev;
+}
+
+static void lru_push(uint32_t off)
+{
+    shm_entry *e = ENTRY(off);
+
+    e->prev = NIL;
+    e->next = shm->lru_head;
+    if (shm->lru_head != NIL)
+        ENTRY(shm->lru_head)->prev = off;
+    else
+        shm->lru_tail = off;
+    shm->lru_head = off;
+}
+
+// Take an entry out of the cache, and free its chunk.
+static void evict(uint32_t off)
+{
+    shm_entry *e = ENTRY(off);
+    uint32_t *link = &shm->buckets[hash(e->data) % SHM_BUCKETS];
+
+    while (*link != off)
+        link = &ENTRY(*link)->chain;
+    *link = e->chain;
+    lru_unlink(off);
+
+    shm->entries--;
+    bloom_remove(shm->filter, e->data);
+    shm->stored -= e->size;
+    shm->original_bytes -= e->original_size;
+    arena_free(&shm->chunks, arena, off);
+}
+
+// Fill view with the entry at off (pointing into this process' mapping). NULL if off is NIL.
+static cache_block *view_of(uint32_t off, cache_block *view)
+{
+    shm_entry *e;
+
+    if (off == NIL)
+        return NULL;
+    e = ENTRY(off);
+    view->request_header = e->data;
+    view->vary = e->vary_len ? e->data + e->header_len + 1 : NULL;
+    view->variant_key = e->vary_len ? e->data + e->header_len + 1 + e->vary_len + 1 : NULL;
+    view->response_header = e->data + e->header_len + 1 + e->vary_len + 1 + e->key_len + 1;
+    view->header_len = response_header_length(view->response_header, e->size);
+    view->body = view->response_header + view->header_len;
+    view->body_ref = NULL;
+    view->size = e->size;
+    view->original_size = e->original_size;
+    view->encoding = e->encoding;
+    view->hits = e->hits;
+    view->bans_seen = 0;
+    view->mapped = 1;
+    view->entry = off;
+    view->prev = view->next = NULL;
+    return view;
+}
+
+// No entries: one free chunk, the whole arena.
+static void empty()
+{
+    int i;
+
+    shm->lru_head = shm->lru_tail = NIL;
+    for (i = 0; i < SHM_BUCKETS; i++)
+        shm->buckets[i] = NIL;
+    shm->entries = shm->stored = shm->original_bytes = 0;
+    memset(shm->filter, 0, sizeof(shm->filter));
+    arena_chunks_init(&shm->chunks, arena);
+}
+
+static int alive(int32_t pid)
+{
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+// Take back what processes that died held of the lock. Caller holds its mutex.
+static void reap()
+{
+    shm_lock *l = &shm->lock;
+    int i;
+
+    for (i = 0; i < SHM_LOCK_HOLDERS; i++)
+    {
+        if (l->holders[i].pid != 0 && l->holders[i].pid != own_pid && !alive(l->holders[i].pid))
+        {
+            if (l->holders[i].readers > 0 || l->holders[i].waiting > 0)
+                fprintf(stderr, "shared cache: proxy %d died holding (or waiting for) its lock. taking it back.\n", l->holders[i].pid);
+            memset(&l->holders[i], 0, sizeof(shm_holder));
+        }
+    }
+    if (l->writer != 0 && l->writer != own_pid && !alive(l->writer))
+    {
+        fprintf(stderr, "shared cache: proxy %d died changing it. emptying it.\n", l->writer);
+        empty();
+        l->writer = 0;
+    }
+    pthread_cond_broadcast(&l->released);
+}
+
+static void lock_mutex()
+{
+    if (pthread_mutex_lock(&shm->lock.mutex) == EOWNERDEAD)
+    {
+        // (it died in the middle of the few stores the mutex guards, which leave it consistent.)
+        pthread_mutex_consistent(&shm->lock.mutex);
+        reap();
+    }
+}
+
+// Wait (holding the mutex, which is let go meanwhile) for the lock to be let go of, or for
+// SHM_LOCK_CHECK_MS, after which the holders are checked.
+static void wait_released()
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += SHM_LOCK_CHECK_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    switch (pthread_cond_timedwait(&shm->lock.released, &shm->lock.mutex, &deadline))
+    {
+    case EOWNERDEAD:
+        pthread_mutex_consistent(&shm->lock.mutex);
+        // (fall through)
+    case ETIMEDOUT:
+        reap();
+        break;
+    }
+}
+
+// Threads (of all processes) holding the lock for reading; or waiting to write.
+static int readers()
+{
+    int i, n = 0;
+
+    for (i = 0; i < SHM_LOCK_HOLDERS; i++)
+        n += shm->lock.holders[i].readers;
+    return n;
+}
+
+static int writers_waiting()
+{
+    int i, n = 0;
+
+    for (i = 0; i < SHM_LOCK_HOLDERS; i++)
+        n += shm->lock.holders[i].waiting;
+    return n;
+}
+
+// Take the lock for reading (a writer waiting goes first), for writing, or let go of it.
+void shm_cache_rdlock()
+{
+    lock_mutex();
+    while (shm->lock.writer != 0 || writers_waiting() > 0)
+        wait_released();
+    own->readers++;
+    pthread_mutex_unlock(&shm->lock.mutex);
+}
+
+void shm_cache_wrlock()
+{
+    lock_mutex();
+    own->waiting++;
+    while (shm->lock.writer != 0 || readers() > 0)
+        wait_released();
+    own->waiting--;
+    shm->lock.writer = own_pid;
+    pthread_mutex_unlock(&shm->lock.mutex);
+}
+
+void shm_cache_unlock()
+{
+    lock_mutex();
+    // (while one of our threads writes, none reads: it is that one.)
+    if (shm->lock.writer == own_pid)
+        shm->lock.writer = 0;
+    else
+        own->readers--;
+    if (shm->lock.writer == 0 && readers() == 0)
+        pthread_cond_broadcast(&shm->lock.released);
+    pthread_mutex_unlock(&shm->lock.mutex);
+}
+
+// Set up the lock in a new segment.
+static void lock_init(shm_lock *l)
+{
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&l->mutex, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&l->released, &cattr);
+    pthread_condattr_destroy(&cattr);
+}
+
+// A slot among the lock's holders for this process (one a dead process had will do). -1 if there is none.
+static int join_lock()
+{
+    int i;
+
+    own_pid = getpid();
+    lock_mutex();
+    reap();
+    for (i = 0; i < SHM_LOCK_HOLDERS && shm->lock.holders[i].pid != 0; i++)
+        ;
+    if (i < SHM_LOCK_HOLDERS)
+    {
+        own = &shm->lock.holders[i];
+        own->pid = own_pid;
+    }
+    pthread_mutex_unlock(&shm->lock.mutex);
+    return i < SHM_LOCK_HOLDERS ? 0 : -1;
+}
+
+// Map the segment called name (see shm_open), creating and setting it up if there is none yet.
+// Returns 0 (callers then take its lock around every cache call, as with the private cache), or -1
+// if it can't be had. *created says whether it was new (and so empty). numa_node and *backing:
+// see arena_map.
+int shm_cache_attach(char *name, int numa_node, int *created, int *backing)
+{
+    int fd, i;
+    struct stat st;
+    struct timespec pause = {0, 1000000}; // 1ms
+
+    *created = 1;
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST)
+    {
+        *created = 0;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (fd < 0)
+        return -1;
+
+    if (*created)
+    {
+        if (ftruncate(fd, SEGMENT_SIZE) < 0)
+        {
+            close(fd);
+            shm_unlink(name);
+            return -1;
+        }
+    }
+    else
+    {
+        // (the process that created it may not have sized it yet.)
+        for (i = 0; i < 1000 && fstat(fd, &st) == 0 && st.st_size == 0; i++)
+            nanosleep(&pause, NULL);
+        if (fstat(fd, &st) < 0 || (size_t)st.st_size != SEGMENT_SIZE)
+        {
+            fprintf(stderr, "shared cache %s: not a cache of this proxy (size %ld)\n", name, (long)st.st_size);
+            close(fd);
+            return -1;
+        }
+    }
+    arena = arena_map(fd, SEGMENT_SIZE, numa_node, backing);
+    close(fd); // the mapping stays.
+    if (arena == NULL)
+        return -1;
+    shm = (shm_header *)(arena + ARENA_SIZE);
+
+    if (*created)
+    {
+        // (ftruncate zeroed it.)
+        shm->segment_size = SEGMENT_SIZE;
+        lock_init(&shm->lock);
+        empty();
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(shm->magic, SHM_CACHE_MAGIC, sizeof(shm->magic));
+    }
+    else
+    {
+        for (i = 0; i < 1000 && memcmp((char *)shm->magic, SHM_CACHE_MAGIC, sizeof(shm->magic)); i++)
+            nanosleep(&pause, NULL);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (memcmp(shm->magic, SHM_CACHE_MAGIC, sizeof(shm->magic)) || shm->segment_size != SEGMENT_SIZE)
+        {
+            fprintf(stderr, "shared cache %s: not a cache of this proxy\n", name);
+            munmap(arena, SEGMENT_SIZE);
+            return -1;
+        }
+    }
+    if (join_lock() < 0)
+    {
+        fprintf(stderr, "shared cache %s: %d proxies share it already\n", name, SHM_LOCK_HOLDERS);
+        munmap(arena, SEGMENT_SIZE);
+        return -1;
+    }
+    return 0;
+}
+
+// As insert_variant: copy the response into a chunk, evicting least recently used entries
+// until it fits (in MAX_CACHE_SIZE, and in the arena). Caller holds the write lock.
+void shm_cache_insert(char *header, char *vary, char *variant_key, char *content, size_t size,
+                      size_t original_size, int encoding)
+{
+    size_t header_len = strlen(header);
+    size_t vary_len = vary != NULL ? strlen(vary) : 0;
+    size_t key_len = vary != NULL && variant_key != NULL ? strlen(variant_key) : 0;
+    size_t need = sizeof(shm_entry) + header_len + 1 + vary_len + 1 + key_len + 1 + size;
+    int order = arena_order(need);
+    uint32_t off, next;
+    shm_entry *e;
+    char *p;
+
+    if (order > ARENA_ORDER || size > MAX_CACHE_SIZE)
+        return;
+
+    // The same response may be in already: several proxies missed on it at the same time,
+    // and each fetched it. The newest copy replaces the older one.
+    for (off = shm->buckets[hash(header) % SHM_BUCKETS]; off != NIL; off = next)
+    {
+        e = ENTRY(off);
+        next = e->chain;
+        if (!strcmp(e->data, header) && e->vary_len == vary_len && e->key_len == key_len &&
+            !memcmp(e->data + e->header_len + 1, vary_len ? vary : "", vary_len) &&
+            !memcmp(e->data + e->header_len + 1 + vary_len + 1, key_len ? variant_key : "", key_len))
+            evict(off);
+    }
+    while (shm->stored + size > MAX_CACHE_SIZE || (off = arena_alloc(&shm->chunks, arena, order)) == NIL)
+    {
+        if (shm->lru_tail == NIL)
+            return;
+        evict(shm->lru_tail);
+    }
+
+    e = ENTRY(off);
+    e->size = size;
+    e->original_size = original_size;
+    e->hits = 0;
+    e->header_len = header_len;
+    e->vary_len = vary_len;
+    e->key_len = key_len;
+    e->encoding = encoding;
+    p = e->data;
+    memcpy(p, header, header_len + 1);
+    p += header_len + 1;
+    memcpy(p, vary_len ? vary : "", vary_len + 1);
+    p += vary_len + 1;
+    memcpy(p, key_len ? variant_key : "", key_len + 1);
+    p += key_len + 1;
+    memcpy(p, content, size);
+
+    e->chain = shm->buckets[hash(header) % SHM_BUCKETS];
+    shm->buckets[hash(header) % SHM_BUCKETS] = off;
+    lru_push(off);
+    shm->entries++;
+    bloom_add(shm->filter, header);
+    shm->stored += size;
+    shm->original_bytes += original_size;
+}
+
+// The entries cached for request (its variants), one at a time: the first one into view
+// (or NULL if there is none), then the next one after view. Caller holds (at least) the read lock.
+cache_block *shm_cache_lookup(char *request, cache_block *view)
+{
+    uint32_t off = shm->buckets[hash(request) % SHM_BUCKETS];
+
+    while (off != NIL && strcmp(ENTRY(off)->data, request))
+        off = ENTRY(off)->chain;
+    return view_of(off, view);
+}
+
+cache_block *shm_cache_lookup_next(char *request, cache_block *view)
+{
+    uint32_t off = ENTRY(view->entry)->chain;
+
+    while (off != NIL && strcmp(ENTRY(off)->data, request))
+        off = ENTRY(off)->chain;
+    return view_of(off, view);
+}
+
+// All entries, least recently used first (as cache_save wants them).
+cache_block *shm_cache_oldest(cache_block *view)
+{
+    return view_of(shm->lru_tail, view);
+}
+
+cache_block *shm_cache_newer(cache_block *view)
+{
+    return view_of(ENTRY(view->entry)->prev, view);
+}
+
+// As move_to_head. Caller holds the write lock.
+void shm_cache_touch(cache_block *view)
+{
+    ENTRY(view->entry)->hits++;
+    lru_unlink(view->entry);
+    lru_push(view->entry);
+}
+
+// Remove the entries that match (match(view, arg) is called with each, in view). Returns how many.
+// Caller holds the write lock.
+long shm_cache_remove_if(int (*match)(cache_block *view, void *arg), void *arg, cache_block *view)
+{
+    uint32_t off, prev;
+    long removed = 0;
+
+    for (off = shm->lru_tail; off != NIL; off = prev)
+    {
+        prev = ENTRY(off)->prev;
+        if (match(view_of(off, view), arg))
+        {
+            evict(off);
+            removed++;
+        }
+    }
+    return removed;
+}
+
+// The filter of the request lines in the segment (for cache_may_have).
+uint8_t *shm_cache_filter()
+{
+    return shm->filter;
+}
+
+// Numbers for cache_report; chunk_bytes: how much of the arena is in use. Caller holds (at least) the read lock.
+void shm_cache_stats(unsigned long *entries, size_t *stored, size_t *original_bytes, size_t *chunk_bytes)
+{
+    *entries = shm->entries;
+    *stored = shm->stored;
+    *original_bytes = shm->original_bytes;
+    *chunk_bytes = shm->chunks.chunk_bytes;
+}
@@ -0,0 +1,44 @@
+/*
+The cache in a POSIX shared-memory segment (see -m), so that the proxy processes on a host
+that name the same segment share one cache, instead of each keeping its own copy of the
+hot objects. The segment is mapped at a different address in every process, so everything
+in it refers to everything else by offset; its memory is an arena (see arena.h) that is handed
+out in power-of-two chunks, and one lock guards all of it.
+The lock is a reader-writer lock of its own, kept by process: a robust mutex (held only while
+the lock's state is changed) guards how many threads of each process hold it for reading or
+wait to write, and which process holds it for writing. A proxy that dies holding it (killed
+-9, say) can't leave the others waiting for ever: a process that waits checks every
+SHM_LOCK_CHECK_MS that the holders are still alive, and takes back what a dead one held. If it
+held the lock for writing, the cache may be half-changed, and it is emptied.
+Used through cache.c, which hands out cache_blocks that are views of the entries in here.
+ */
+#ifndef SHMCACHE_H
+#define SHMCACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define SHM_CACHE_MAGIC "PXYSHM05"  // first 8 bytes of an initialized segment
+#define SHM_BUCKETS 1024            // hash buckets, by request line
+#define SHM_LOCK_HOLDERS 64         // processes that may share a segment at once
+#define SHM_LOCK_CHECK_MS 100       // how often a process waiting for the lock checks its holders are alive
+
+struct cache_block; // cache.h
+
+int  shm_cache_attach(char *name, int numa_node, int *created, int *backing);
+void shm_cache_rdlock();
+void shm_cache_wrlock();
+void shm_cache_unlock();
+void shm_cache_insert(char *header, char *vary, char *variant_key, char *content, size_t size,
+                      size_t original_size, int encoding);
+struct cache_block *shm_cache_lookup(char *request, struct cache_block *view);
+struct cache_block *shm_cache_lookup_next(char *request, struct cache_block *view);
+struct cache_block *shm_cache_oldest(struct cache_block *view);
+struct cache_block *shm_cache_newer(struct cache_block *view);
+void shm_cache_touch(struct cache_block *view);
+long shm_cache_remove_if(int (*match)(struct cache_block *view, void *arg), void *arg, struct cache_block *view);
+uint8_t *shm_cache_filter();
+void shm_cache_stats(unsigned long *entries, size_t *stored, size_t *original_bytes, size_t *chunk_bytes);
+
+#endif/*SHMCACHE_H*/
@@ -0,0 +1,56 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "strbuf.h"
+
+void strbuf_init(strbuf *sb, char *storage, size_t cap)
+{
+    sb->data = storage;
+    sb->len = 0;
+    sb->cap = cap;
+    if (cap > 0)
+        sb->data[0] = '\0';
+}
+
+// Append n bytes of s. Returns 0 on success, and -1 (leaving sb untouched) if it doesn't fit.
+int strbuf_append(strbuf *sb, const char *s, size_t n)
+{
+    if (sb->len + n + 1 > sb->cap)
+    {
+        return -1;
+    }
+    memcpy(sb->data + sb->len, s, n);
+    sb->len += n;
+    sb->data[sb->len] = '\0';
+    return 0;
+}
+
+int strbuf_appends(strbuf *sb, const char *s)
+{
+    return strbuf_append(sb, s, strlen(s));
+}
+
+// printf-style append, formatted directly into the free space at the end of the buffer.
+int strbuf_appendf(strbuf *sb, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (sb->len + 1 > sb->cap)
+    {
+        return -1;
+    }
+
+    va_start(ap, fmt);
+    n = vsnprintf(sb->data + sb->len, sb->cap - sb->len, fmt, ap);
+    va_end(ap);
+
+    if (n < 0 || sb->len + n + 1 > sb->cap)
+    {
+        // didn't fit; drop the partial write.
+        sb->data[sb->len] = '\0';
+        return -1;
+    }
+    sb->len += n;
+    return 0;
+}
@@ -0,0 +1,26 @@
+/*
+An append-only string builder on top of caller-provided storage.
+It tracks its own length, so appending never rescans what is already written
+(which is what `strcat` does, every single time).
+ */
+#ifndef STRBUF_H
+#define STRBUF_H
+
+#include <stddef.h>
+
+typedef struct strbuf
+{
+    char *data; // caller-provided storage; always null-terminated.
+    size_t len; // bytes written so far (excluding the null terminator).
+    size_t cap; // size of data (including room for the null terminator).
+} strbuf;
+
+/* Append a string literal (or char array) without calling strlen on it. */
+#define strbuf_append_lit(sb, lit) strbuf_append((sb), (lit), sizeof(lit) - 1)
+
+void strbuf_init(strbuf *sb, char *storage, size_t cap);
+int strbuf_append(strbuf *sb, const char *s, size_t n);
+int strbuf_appends(strbuf *sb, const char *s);
+int strbuf_appendf(strbuf *sb, const char *fmt, ...);
+
+#endif/*STRBUF_H*/
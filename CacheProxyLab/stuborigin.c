@@ -0,0 +1,140 @@
+/*
+A stub origin server, for benchmarking the proxy offline (see loadgen.c).
+
+Serves GET /<anything> with a generated text body. The body size is derived from
+the path, so the same URL always gets an object of the same size. Every response
+carries a fresh `X-Stub-Serial` header, which lets loadgen tell cache hits
+(an old serial, replayed by the proxy) from misses (a new one).
+
+usage: ./stuborigin [-s min_size] [-S max_size] [-d delay_ms] <port>
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "io.h"
+
+#define STUB_BACKLOG 1024
+
+static int min_size = 1024;
+static int max_size = 16384;
+static int delay_ms = 0;
+static unsigned long serial = 0; // responses served so far
+
+static unsigned int hash_path(const char *path)
+{
+    unsigned int h = 2166136261u; // FNV-1a
+    for (; *path && *path != ' '; path++)
+        h = (h ^ (unsigned char)*path) * 16777619u;
+    return h;
+}
+
+void *serve(void *args)
+{
+    int fd = (int)(intptr_t)args;
+    char line[MAX_LINE + 1];
+    char path[MAX_LINE + 1] = "/";
+    char header[512];
+    char *body;
+    int n, size, header_len;
+    unsigned long my_serial;
+
+    pthread_detach(pthread_self());
+
+    /* request line, then skip header fields up to the blank line. */
+    n = read_line(fd, line);
+    if (n <= 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    line[n] = '\0';
+    sscanf(line, "%*s %s", path);
+    while ((n = read_line(fd, line)) > 0 && !(n <= 2 && (line[0] == '\r' || line[0] == '\n')))
+        ;
+
+    if (delay_ms > 0)
+        usleep(delay_ms * 1000);
+
+    size = min_size + (max_size > min_size ? hash_path(path) % (max_size - min_size + 1) : 0);
+    my_serial = __atomic_add_fetch(&serial, 1, __ATOMIC_RELAXED);
+    header_len = snprintf(header, sizeof(header),
+                          "HTTP/1.0 200 OK\r\n"
+                          "Content-Type: text/html\r\n"
+                          "Content-Length: %d\r\n"
+                          "X-Stub-Serial: %lu\r\n"
+                          "Connection: close\r\n"
+                          "\r\n",
+                          size, my_serial);
+
+    /* the body is text (the path, repeated), like the pages a proxy mostly caches. */
+    if ((body = malloc(size)) != NULL)
+    {
+        int path_len = strlen(path);
+        for (n = 0; n < size; n++)
+            body[n] = n % 64 == 63 ? '\n' : path[n % path_len];
+        write_all(fd, header, header_len);
+        write_all(fd, body, size);
+        free(body);
+    }
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int opt, listen_fd, fd;
+    struct sockaddr_in addr;
+    pthread_t tid;
+
+    while ((opt = getopt(argc, argv, "s:S:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            min_size = atoi(optarg);
+            break;
+        case 'S':
+            max_size = atoi(optarg);
+            break;
+        case 'd':
+            delay_ms = atoi(optarg);
+            break;
+        default:
+            optind = argc; // print usage
+        }
+    }
+    if (argc - optind != 1 || min_size <= 0)
+    {
+        fprintf(stderr, "usage: %s [-s min_size] [-S max_size] [-d delay_ms] <port>\n", argv[0]);
+        exit(1);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(atoi(argv[optind]));
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, STUB_BACKLOG) < 0)
+    {
+        perror("stuborigin");
+        exit(1);
+    }
+
+    while (1)
+    {
+        fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        pthread_create(&tid, NULL, serve, (void *)(intptr_t)fd);
+    }
+    return 0;
+}
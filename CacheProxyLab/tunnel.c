@@ -0,0 +1,125 @@
+#define _GNU_SOURCE // splice, pipe2, F_GETPIPE_SZ
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "tunnel.h"
+#include "io.h"
+
+/* one direction of a tunnel: bytes are spliced from `from` into the pipe, and from the
+   pipe to `to`. when `from` is done (EOF) and the pipe is empty, `to` is shut down for
+   writing, so the other end sees the EOF too (the other direction may go on). */
+typedef struct direction
+{
+    int from;
+    int to;
+    int pipe[2];      // [0]: read end, [1]: write end
+    size_t capacity;  // of the pipe
+    size_t pending;   // bytes in the pipe
+    int eof;          // from has no more
+    int done;         // to has been shut down
+    size_t *bytes;    // count of the bytes passed on
+} direction;
+
+static int open_direction ( direction *d, int from, int to, size_t *bytes )
+{
+    int size;
+
+    d->from = from;
+    d->to = to;
+    d->pending = 0;
+    d->eof = 0;
+    d->done = 0;
+    d->bytes = bytes;
+    if ( pipe2 ( d->pipe, O_NONBLOCK | O_CLOEXEC ) < 0 ) return -1;
+    size = fcntl ( d->pipe[1], F_GETPIPE_SZ );
+    d->capacity = size > 0 ? (size_t)size : 65536;
+    return 0;
+}
+
+static void close_direction ( direction *d )
+{
+    close ( d->pipe[0] );
+    close ( d->pipe[1] );
+}
+
+/* move what there is: into the pipe, if from was ready, and out of it, if to was.
+   returns 0, or -1 if either socket failed (e.g. was reset). */
+static int step ( direction *d, short from_events, short to_events )
+{
+    ssize_t n;
+
+    if ( from_events ) {
+	n = splice ( d->from, NULL, d->pipe[1], NULL, d->capacity - d->pending,
+		     SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+	if ( n > 0 ) d->pending += n;
+	else if ( n == 0 ) d->eof = 1;
+	else if ( errno != EAGAIN && errno != EINTR ) return -1;
+    }
+    if ( to_events && d->pending > 0 ) {
+	n = splice ( d->pipe[0], NULL, d->to, NULL, d->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+	if ( n > 0 ) {
+	    d->pending -= n;
+	    *d->bytes += n;
+	}
+	else if ( n < 0 && errno != EAGAIN && errno != EINTR ) return -1;
+    }
+    if ( d->eof && d->pending == 0 && !d->done ) {
+	shutdown ( d->to, SHUT_WR );
+	d->done = 1;
+    }
+    return 0;
+}
+
+/* relay a tunnel between client_fd and server_fd (both connected; they are made
+   non-blocking) until both sides are done, one fails, or it is idle for
+   TUNNEL_IDLE_TIMEOUT. early (early_len bytes) is what the client sent after its request,
+   before the tunnel was open; it goes to the origin first. bytes counts what went each way.
+   returns 0 if both sides finished, or -1 otherwise. */
+int tunnel_relay ( int client_fd, int server_fd, char *early, size_t early_len, tunnel_bytes *bytes )
+{
+    direction d[2]; // [0]: client -> origin, [1]: origin -> client
+    struct pollfd ready[4];
+    int i, n;
+    int return_cd = 0;
+
+    bytes->up = 0;
+    bytes->down = 0;
+    if ( early_len > 0 ) {
+	if ( write_all ( server_fd, early, early_len ) < 0 ) return -1;
+	bytes->up = early_len;
+    }
+
+    if ( open_direction ( &d[0], client_fd, server_fd, &bytes->up ) < 0 ) return -1;
+    if ( open_direction ( &d[1], server_fd, client_fd, &bytes->down ) < 0 ) {
+	close_direction ( &d[0] );
+	return -1;
+    }
+    fcntl ( client_fd, F_SETFL, fcntl ( client_fd, F_GETFL ) | O_NONBLOCK );
+    fcntl ( server_fd, F_SETFL, fcntl ( server_fd, F_GETFL ) | O_NONBLOCK );
+
+    while ( !d[0].done || !d[1].done ) {
+	/* (a negative fd is left out: a full pipe, or an empty one, has nothing for it to do) */
+	for ( i = 0; i < 2; i++ ) {
+	    ready[2 * i].fd = !d[i].eof && d[i].pending < d[i].capacity ? d[i].from : -1;
+	    ready[2 * i].events = POLLIN;
+	    ready[2 * i].revents = 0;
+	    ready[2 * i + 1].fd = d[i].pending > 0 ? d[i].to : -1;
+	    ready[2 * i + 1].events = POLLOUT;
+	    ready[2 * i + 1].revents = 0;
+	}
+	n = poll ( ready, 4, TUNNEL_IDLE_TIMEOUT * 1000 );
+	if ( n < 0 && errno == EINTR ) continue;
+	if ( n <= 0 ) { return_cd = -1; break; } // idle (or poll failed).
+
+	for ( i = 0; i < 2; i++ ) {
+	    if ( step ( &d[i], ready[2 * i].revents, ready[2 * i + 1].revents ) < 0 ) return_cd = -1;
+	}
+	if ( return_cd < 0 ) break;
+    }
+
+    close_direction ( &d[0] );
+    close_direction ( &d[1] );
+    return return_cd;
+}
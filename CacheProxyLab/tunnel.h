@@ -0,0 +1,22 @@
+/*
+The relay for a CONNECT tunnel (e.g. for HTTPS): once it is open, the bytes the client and
+the origin send each other are passed on as they are, both ways at once, until both are done.
+Each direction goes through a pipe with splice(), so that the kernel moves the bytes from one
+socket to the other without copying them into (or out of) the proxy's memory.
+ */
+#ifndef TUNNEL_H
+#define TUNNEL_H
+
+#include <stddef.h>
+
+#define TUNNEL_IDLE_TIMEOUT 300 // seconds a tunnel may carry nothing (either way) before it is closed
+
+typedef struct tunnel_bytes
+{
+    size_t up;   // client -> origin
+    size_t down; // origin -> client
+} tunnel_bytes;
+
+int tunnel_relay ( int client_fd, int server_fd, char *early, size_t early_len, tunnel_bytes *bytes );
+
+#endif/*TUNNEL_H*/
@@ -0,0 +1,116 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+/* the kernel reads what we put in the queues, and we read what it puts there, so
+   the indices it shares with us are loaded with acquire, and stored with release. */
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/* set up a ring with (at least) `entries` submission queue entries.
+   returns 0, or -1 if the kernel has no io_uring (or won't let us have one). */
+int uring_init ( uring *r, unsigned entries )
+{
+    struct io_uring_params p;
+    unsigned *array;
+    unsigned i;
+
+    memset ( r, 0, sizeof(*r) );
+    memset ( &p, 0, sizeof(p) );
+    r->fd = syscall ( __NR_io_uring_setup, entries, &p );
+    if ( r->fd < 0 ) return -1;
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    /* since 5.4 both queues are in one mapping. */
+    if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+	if ( r->cq_ring_size > r->sq_ring_size ) r->sq_ring_size = r->cq_ring_size;
+	r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sq_ring = mmap ( NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->fd, IORING_OFF_SQ_RING );
+    if ( r->sq_ring == MAP_FAILED ) goto fail;
+    if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+	r->cq_ring = r->sq_ring;
+    } else {
+	r->cq_ring = mmap ( NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			    r->fd, IORING_OFF_CQ_RING );
+	if ( r->cq_ring == MAP_FAILED ) { munmap ( r->sq_ring, r->sq_ring_size ); goto fail; }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap ( NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		     r->fd, IORING_OFF_SQES );
+    if ( r->sqes == MAP_FAILED ) { uring_exit ( r ); return -1; }
+
+    r->sq_head = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sqe_tail = *r->sq_tail;
+    r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+
+    /* the submission queue holds indices into sqes; entry i always uses sqes[i]. */
+    array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+    for ( i = 0; i < p.sq_entries; i++ ) array[i] = i;
+    return 0;
+
+ fail:
+    close ( r->fd );
+    return -1;
+}
+
+/* tear the ring down. requests still in flight are cancelled. */
+void uring_exit ( uring *r )
+{
+    if ( r->sqes != NULL && r->sqes != MAP_FAILED ) munmap ( r->sqes, r->sqes_size );
+    if ( r->cq_ring != r->sq_ring ) munmap ( r->cq_ring, r->cq_ring_size );
+    munmap ( r->sq_ring, r->sq_ring_size );
+    close ( r->fd );
+}
+
+/* the next free submission queue entry (zeroed), or NULL if the queue is full.
+   it goes to the kernel with the next uring_submit_and_wait. */
+struct io_uring_sqe *uring_get_sqe ( uring *r )
+{
+    struct io_uring_sqe *sqe;
+
+    if ( r->sqe_tail - load_acquire ( r->sq_head ) >= r->sq_entries ) return NULL;
+    sqe = &r->sqes[r->sqe_tail & *r->sq_mask];
+    memset ( sqe, 0, sizeof(*sqe) );
+    r->sqe_tail++;
+    return sqe;
+}
+
+/* submit the entries got since the last call, and wait until there are at least
+   `wait_nr` completions, all in one system call. returns the number of entries
+   submitted, or -1 (see errno; EINTR: try again). */
+int uring_submit_and_wait ( uring *r, unsigned wait_nr )
+{
+    /* (entries the kernel did not take last time are submitted again.) */
+    unsigned submit = r->sqe_tail - load_acquire ( r->sq_head );
+
+    store_release ( r->sq_tail, r->sqe_tail );
+    return syscall ( __NR_io_uring_enter, r->fd, submit, wait_nr,
+		     wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0 );
+}
+
+/* the oldest completion not yet seen, or NULL if there is none (this does not wait). */
+struct io_uring_cqe *uring_peek_cqe ( uring *r )
+{
+    unsigned head = *r->cq_head;
+
+    if ( head == load_acquire ( r->cq_tail ) ) return NULL;
+    return &r->cqes[head & *r->cq_mask];
+}
+
+/* done with the completion from uring_peek_cqe: the kernel may reuse its entry. */
+void uring_cqe_seen ( uring *r )
+{
+    store_release ( r->cq_head, *r->cq_head + 1 );
+}
@@ -0,0 +1,39 @@
+/*
+A minimal io_uring, on the raw system calls (no liburing): one submission queue and
+one completion queue, shared with the kernel through mmap. A ring is used by one
+thread only (see acceptLoopUring in proxy.c, with -U).
+ */
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+typedef struct uring
+{
+    int fd;
+    unsigned *sq_head;           // (kernel) next entry it consumes
+    unsigned *sq_tail;           // (us) end of the entries we submitted
+    unsigned *sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;           // end of the entries handed out by uring_get_sqe
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;           // (us) next completion we consume
+    unsigned *cq_tail;           // (kernel) end of the completions it posted
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;               // mappings, for uring_exit
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring;
+
+int  uring_init ( uring *r, unsigned entries );
+void uring_exit ( uring *r );
+struct io_uring_sqe *uring_get_sqe ( uring *r );
+int  uring_submit_and_wait ( uring *r, unsigned wait_nr );
+struct io_uring_cqe *uring_peek_cqe ( uring *r );
+void uring_cqe_seen ( uring *r );
+
+#endif/*URING_H*/
@@ -0,0 +1,130 @@
+#include <string.h>
+#include "xxhash.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+// (unaligned, little-endian loads; memcpy compiles to a plain load)
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static uint64_t merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= round64(0, val);
+    return acc * PRIME1 + PRIME4;
+}
+
+// One 32-byte stripe into the accumulators.
+static void stripe(xxh64_state *state, const unsigned char *p)
+{
+    state->v[0] = round64(state->v[0], read64(p));
+    state->v[1] = round64(state->v[1], read64(p + 8));
+    state->v[2] = round64(state->v[2], read64(p + 16));
+    state->v[3] = round64(state->v[3], read64(p + 24));
+}
+
+void xxh64_init(xxh64_state *state)
+{
+    memset(state, 0, sizeof(*state));
+    state->v[0] = PRIME1 + PRIME2;
+    state->v[1] = PRIME2;
+    state->v[2] = 0;
+    state->v[3] = -PRIME1;
+}
+
+void xxh64_update(xxh64_state *state, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+    size_t take;
+
+    state->total += len;
+    if (state->buffered > 0)
+    {
+        take = 32 - state->buffered < len ? 32 - state->buffered : len;
+        memcpy(state->buf + state->buffered, p, take);
+        state->buffered += take;
+        p += take;
+        if (state->buffered < 32)
+            return;
+        stripe(state, state->buf);
+        state->buffered = 0;
+    }
+    for (; end - p >= 32; p += 32)
+        stripe(state, p);
+    memcpy(state->buf, p, end - p);
+    state->buffered = end - p;
+}
+
+uint64_t xxh64_digest(xxh64_state *state)
+{
+    const unsigned char *p = state->buf;
+    const unsigned char *end = p + state->buffered;
+    uint64_t h;
+
+    if (state->total >= 32)
+    {
+        h = rotl(state->v[0], 1) + rotl(state->v[1], 7) + rotl(state->v[2], 12) + rotl(state->v[3], 18);
+        h = merge_round(h, state->v[0]);
+        h = merge_round(h, state->v[1]);
+        h = merge_round(h, state->v[2]);
+        h = merge_round(h, state->v[3]);
+    }
+    else
+    {
+        h = state->v[2] + PRIME5; // (v[2] is the seed)
+    }
+    h += state->total;
+
+    for (; end - p >= 8; p += 8)
+        h = rotl(h ^ round64(0, read64(p)), 27) * PRIME1 + PRIME4;
+    if (end - p >= 4)
+    {
+        h = rotl(h ^ (read32(p) * PRIME1), 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = rotl(h ^ (*p * PRIME5), 11) * PRIME1;
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t xxh64(const void *data, size_t len)
+{
+    xxh64_state state;
+
+    xxh64_init(&state);
+    xxh64_update(&state, data, len);
+    return xxh64_digest(&state);
+}
@@ -0,0 +1,25 @@
+/*
+XXH64 (https://github.com/Cyan4973/xxHash), a fast non-cryptographic 64-bit hash, in one
+go or fed piece by piece (as a response arrives). Keys the cache's bodies (see cache.c),
+so byte-identical bodies are stored once.
+ */
+#ifndef XXHASH_H
+#define XXHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct xxh64_state
+{
+    uint64_t total;           // bytes hashed so far
+    uint64_t v[4];            // accumulators, one per 8 bytes of each 32-byte stripe
+    unsigned char buf[32];    // the start of an incomplete stripe
+    size_t buffered;
+} xxh64_state;
+
+void xxh64_init(xxh64_state *state);
+void xxh64_update(xxh64_state *state, const void *data, size_t len);
+uint64_t xxh64_digest(xxh64_state *state);
+uint64_t xxh64(const void *data, size_t len);
+
+#endif/*XXHASH_H*/